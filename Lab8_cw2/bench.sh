@@ -0,0 +1,83 @@
+#!/bin/sh
+# bench.sh - times dependencyDiscoverer over test/, the unseen/ tree and
+# synthetic include graphs from gengraph, for each CRAWLER_THREADS value, and
+# checks every output is exactly that of the sequential version
+# (sequential_fromMoodle.cpp); the exit status is 1 if any was not
+#
+# run with "make bench"; these environment variables change what is run:
+#   BENCH_THREADS  thread counts to try       (default "0 1 2 4 8 16")
+#   BENCH_SHAPES   gengraph shapes            (default "fanout chain diamond cycle")
+#   BENCH_SIZES    gengraph file counts       (default "10000")
+#   BENCH_RUNS     runs per point, best kept  (default 3)
+#   BENCH_DIR      where synthetic trees go   (default /tmp/ddbench.$$)
+#   UNSEEN         the unseen/ tree
+
+THREADS=${BENCH_THREADS:-"0 1 2 4 8 16"}
+SHAPES=${BENCH_SHAPES:-"fanout chain diamond cycle"}
+SIZES=${BENCH_SIZES:-"10000"}
+RUNS=${BENCH_RUNS:-3}
+DIR=${BENCH_DIR:-/tmp/ddbench.$$}
+HERE=$(pwd)
+UNSEEN=${UNSEEN:-"$HERE/../CW2_aropa_corrections/Coursework_2b_Solution_UnseenDirectory_&_Output-20231129/solution/unseen"}
+
+# time the crawler over the sources in the current directory: prints the best
+# wall time in ms over $RUNS runs and leaves the output in $DIR/out
+best_ms() {
+  best=
+  r=0
+  while [ $r -lt "$RUNS" ]; do
+    t0=$(date +%s%N)
+    CRAWLER_THREADS=$1 "$HERE/dependencyDiscoverer" $(ls | grep '\.[cly]$') > "$DIR/out" 2>/dev/null
+    t1=$(date +%s%N)
+    ms=$(( (t1 - t0) / 1000000 ))
+    if [ -z "$best" ] || [ $ms -lt $best ]; then best=$ms; fi
+    r=$((r + 1))
+  done
+  echo $best
+}
+
+# bench one tree
+bench() {
+  name=$1
+  cd "$2" || return
+  files=$(ls | grep -c '\.[chly]$')
+  "$HERE/sequential" $(ls | grep '\.[cly]$') > "$DIR/expected" 2>/dev/null
+  base=
+  for t in $THREADS; do
+    ms=$(best_ms "$t")
+    [ "$ms" -gt 0 ] || ms=1
+    if cmp -s "$DIR/out" "$DIR/expected"; then check=ok; else check=MISMATCH; mismatches=$((mismatches + 1)); fi
+    # speedup and efficiency are relative to CRAWLER_THREADS=1
+    if [ "$t" = 1 ]; then base=$ms; fi
+    if [ -n "$base" ] && [ "$t" -gt 0 ]; then
+      speedup=$(awk "BEGIN { printf \"%.2f\", $base / $ms }")
+      eff=$(awk "BEGIN { printf \"%.0f%%\", 100 * $base / $ms / $t }")
+    else
+      speedup=-
+      eff=-
+    fi
+    printf "%-16s %8d %8s %8d %12d %8s %6s  %s\n" "$name" "$files" "$t" "$ms" \
+           $((files * 1000 / ms)) "$speedup" "$eff" "$check"
+  done
+  cd "$HERE"
+}
+
+mismatches=0
+mkdir -p "$DIR" || exit 1
+printf "%-16s %8s %8s %8s %12s %8s %6s  %s\n" tree files threads ms files/s speedup eff check
+bench test "$HERE/test"
+[ -d "$UNSEEN" ] && bench unseen "$UNSEEN"
+for size in $SIZES; do
+  for shape in $SHAPES; do
+    tree="$DIR/$shape-$size"
+    if [ ! -d "$tree" ]; then
+      mkdir -p "$tree" && "$HERE/gengraph" "$shape" "$size" "$tree" || exit 1
+    fi
+    bench "$shape-$size" "$tree"
+  done
+done
+[ -n "$BENCH_DIR" ] || rm -rf "$DIR"
+if [ $mismatches -gt 0 ]; then
+  echo "bench.sh: $mismatches outputs differ from the sequential version" >&2
+  exit 1
+fi
@@ -0,0 +1,574 @@
+/*
+ * concurrent.h - the crawler's shared containers, and the statistics they
+ * keep when CRAWLER_STATS is set
+ *
+ * usage:
+ *
+ *   ConcQueue q;
+ *   q.push_back("foo.h");
+ *   std::string s;
+ *   while ((s = q.get_next()) != "") {
+ *     ...            // may push_back() more
+ *     q.done();
+ *   }
+ *
+ *   ConcMap m;
+ *   m.insert({ "foo.h", {} });
+ *   DepList *ll = m.get("foo.h");
+ *
+ * ConcQueue is a queue of file names that also knows when no more work can
+ * come; ConcMap maps file names to their lists of dependencies. Both take
+ * their locks through crawlStats, which counts how often each was contended.
+ * A name pushed with push_back() is interned in the queue's own NameTable,
+ * which clear() empties once the queue is idle; one that outlives its time
+ * in the queue, such as a key of a ConcMap, is pushed with push_stable()
+ * instead, which takes no lock.
+ *
+ * stress.cpp hammers both from many threads and checks what they returned
+ */
+
+#ifndef CONCURRENT_H
+#define CONCURRENT_H
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <list>
+#include <deque>
+#include <memory>
+#include <memory_resource>
+
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+static inline uint64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief What one crawler thread did, collected when CRAWLER_STATS is set
+*/
+struct WorkerStats
+{
+  unsigned long files = 0;   // files processed
+  unsigned long bytes = 0;   // bytes scanned
+  unsigned long prefetched = 0; // files opened by a prefetch thread
+  uint64_t startNs = 0;      // when the thread started
+  uint64_t endNs = 0;        // when it ran out of work
+  uint64_t openNs = 0;       // time in openFile()
+  uint64_t scanNs = 0;       // time mapping, hashing and scanning files
+  uint64_t queueWaitNs = 0;  // time waiting for work, or blocked on ConcQueue::m
+  uint64_t mapWaitNs = 0;    // time blocked on ConcMap::m
+};
+
+/**
+ * @brief How often a mutex was taken and how often it was already held
+*/
+struct LockStats
+{
+  std::atomic<unsigned long> acquired{0};
+  std::atomic<unsigned long> contended{0};
+  uint64_t WorkerStats::*waitNs;
+
+  explicit LockStats(uint64_t WorkerStats::*w) : waitNs(w) {}
+};
+
+inline thread_local WorkerStats *myStats = nullptr;
+
+/**
+ * @brief The crawl statistics of all threads
+*/
+struct CrawlStats
+{
+  bool enabled = false;
+  uint64_t startNs = 0;
+  uint64_t endNs = 0;
+  int numThreads = 0;
+  LockStats queueLock{&WorkerStats::queueWaitNs};
+  LockStats mapLock{&WorkerStats::mapWaitNs};
+  std::vector<std::unique_ptr<WorkerStats>> workers;
+  std::mutex m; // protects workers
+  // workQ depth samples (time since start in us, depth), taken under depthM
+  std::vector<std::pair<uint64_t, size_t>> depth;
+  std::mutex depthM;
+  uint64_t lastSampleNs = 0;
+
+  /**
+   * @brief Locks a mutex, counting contention and charging the wait to the
+   * calling thread
+   * 
+   * @param m The mutex
+   * @param ls The statistics of that mutex
+   * @return std::unique_lock<std::mutex> The held lock
+  */
+  std::unique_lock<std::mutex> lock(std::mutex &m, LockStats &ls) {
+    if (!enabled)
+      return std::unique_lock<std::mutex>(m);
+    ls.acquired++;
+    std::unique_lock<std::mutex> lock(m, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      ls.contended++;
+      uint64_t t0 = nowNs();
+      lock.lock();
+      if (myStats)
+        myStats->*ls.waitNs += nowNs() - t0;
+    }
+    return lock;
+  }
+
+  /**
+   * @brief Records the workQ depth, at most one sample every 50us
+   * 
+   * @param size The current depth
+   * @return void
+  */
+  void sampleDepth(size_t size) {
+    std::unique_lock<std::mutex> lock(depthM, std::try_to_lock);
+    if (!lock.owns_lock())
+      return; // another thread is taking a sample
+    uint64_t t = nowNs();
+    if (!depth.empty() && t - lastSampleNs < 50000)
+      return;
+    lastSampleNs = t;
+    depth.emplace_back((t - startNs) / 1000, size);
+  }
+
+  /**
+   * @brief Gives the calling thread a WorkerStats of its own
+   * 
+   * @return void
+  */
+  void registerThread() {
+    auto ws = std::make_unique<WorkerStats>();
+    ws->startNs = nowNs();
+    myStats = ws.get();
+    std::unique_lock<std::mutex> lock(m);
+    workers.push_back(std::move(ws));
+  }
+
+  /**
+   * @brief Forgets everything collected so far
+   * 
+   * @return void
+  */
+  void reset() {
+    workers.clear();
+    depth.clear();
+    queueLock.acquired = queueLock.contended = 0;
+    mapLock.acquired = mapLock.contended = 0;
+  }
+
+  /**
+   * @brief Prints everything as JSON
+   * 
+   * @param fd Where to print
+   * @return void
+  */
+  void report(FILE *fd) {
+    fprintf(fd, "{\"threads\": %d, \"wall_ns\": %" PRIu64 ", \"workers\": [",
+            numThreads, endNs - startNs);
+    for (size_t i = 0; i < workers.size(); i++) {
+      const WorkerStats &w = *workers[i];
+      uint64_t idle = (w.startNs - startNs) + (endNs - w.endNs);
+      fprintf(fd, "%s\n  {\"id\": %zu, \"files\": %lu, \"prefetched\": %lu, \"bytes\": %lu, "
+              "\"open_ns\": %" PRIu64 ", \"scan_ns\": %" PRIu64 ", "
+              "\"queue_wait_ns\": %" PRIu64 ", \"map_wait_ns\": %" PRIu64 ", "
+              "\"idle_ns\": %" PRIu64 "}", i ? "," : "", i, w.files, w.prefetched, w.bytes,
+              w.openNs, w.scanNs, w.queueWaitNs, w.mapWaitNs, idle);
+    }
+    fprintf(fd, "],\n \"locks\": {\"queue\": {\"acquired\": %lu, \"contended\": %lu}, "
+            "\"map\": {\"acquired\": %lu, \"contended\": %lu}},\n \"queue_depth\": [",
+            queueLock.acquired.load(), queueLock.contended.load(),
+            mapLock.acquired.load(), mapLock.contended.load());
+    for (size_t i = 0; i < depth.size(); i++)
+      fprintf(fd, "%s[%" PRIu64 ", %zu]", i ? ", " : "", depth[i].first, depth[i].second);
+    fprintf(fd, "]}\n");
+  }
+};
+
+inline CrawlStats crawlStats;
+
+/**
+ * @brief Interns file names as numbers
+ * 
+ * A name's number never changes until clear() and its string never moves:
+ * strings live in chunks of CHUNK that are never freed before the table is,
+ * so a number can be turned back into its name without taking the lock.
+ * clear() keeps the chunks for the names interned after it.
+*/
+struct NameTable
+{
+  static const uint32_t CHUNK = 4096;
+  static const uint32_t MAX_CHUNKS = 1 << 16;
+  std::unordered_map<std::string, uint32_t> ids;
+  std::unique_ptr<std::atomic<std::string *>[]> chunks{new std::atomic<std::string *>[MAX_CHUNKS]()};
+  uint32_t count = 0;
+  std::mutex m;
+
+  ~NameTable() {
+    for (uint32_t c = 0; c < MAX_CHUNKS && chunks[c]; c++)
+      delete[] chunks[c].load();
+  }
+
+  /**
+   * @brief Returns the number of a name, giving it the next one if it is new
+   * 
+   * @param name The name
+   * @return uint32_t Its number
+  */
+  uint32_t intern(const std::string &name) {
+    std::unique_lock<std::mutex> lock(m);
+    auto ins = ids.insert({ name, count });
+    if (!ins.second)
+      return ins.first->second;
+    if (count / CHUNK >= MAX_CHUNKS) {
+      fprintf(stderr, "Too many files\n");
+      exit(-1);
+    }
+    std::string *chunk = chunks[count / CHUNK].load(std::memory_order_relaxed);
+    if (chunk == nullptr)
+      chunk = new std::string[CHUNK];
+    chunk[count % CHUNK] = name;
+    chunks[count / CHUNK].store(chunk, std::memory_order_release);
+    return count++;
+  }
+
+  const std::string &name(uint32_t id) const {
+    return chunks[id / CHUNK].load(std::memory_order_acquire)[id % CHUNK];
+  }
+
+  // forget every name, when no number handed out is in use any more
+  void clear() {
+    std::unique_lock<std::mutex> lock(m);
+    ids.clear();
+    for (uint32_t i = 0; i < count; i++)
+      chunks[i / CHUNK].load(std::memory_order_relaxed)[i % CHUNK].clear();
+    count = 0;
+  }
+};
+
+/**
+ * @brief A concurrent queue of strings
+ * 
+ * The queue holds views of strings kept elsewhere, in a bounded lock-free
+ * ring of CAPACITY pre-allocated slots, in which each slot has a sequence
+ * number saying whether it is ready to be written or read (Vyukov's bounded
+ * MPMC queue). push_stable() takes a string that stays put until it is
+ * popped, such as a key of the crawl's table, so it and popping allocate
+ * nothing and take no lock; push_back() first interns its string (see
+ * NameTable), which takes the table's lock and copies a new string. If the
+ * ring is full, views go to an overflow list under m.
+ * 
+ * The queue also counts the strings pushed but not yet finished with (see
+ * done()), so that get_next() can tell "empty for now" from "no work left":
+ * an idle caller sleeps on a futex until a push or the last done() wakes it.
+*/
+struct ConcQueue
+{
+  static const size_t CAPACITY = 4096; // a power of two
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    std::string_view s;
+  };
+  std::unique_ptr<Slot[]> slots;
+  alignas(64) std::atomic<uint64_t> head{0}; // next slot to push to
+  alignas(64) std::atomic<uint64_t> tail{0}; // next slot to pop from
+  alignas(64) std::atomic<size_t> queued{0}; // strings in the queue
+  std::atomic<size_t> pending{0};  // strings pushed and not yet done()
+  std::atomic<uint32_t> epoch{0};  // the futex word, bumped by every wake
+  std::atomic<uint32_t> sleepers{0};
+  std::pmr::unsynchronized_pool_resource overflowArena; // used under m
+  std::pmr::deque<std::string_view> overflow{&overflowArena};
+  std::atomic<size_t> overflowSize{0};
+  std::mutex m; // protects overflow
+  NameTable names; // the strings pushed with push_back()
+
+  ConcQueue() : slots(new Slot[CAPACITY]) {
+    for (size_t i = 0; i < CAPACITY; i++)
+      slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  // push to the ring: false if it is full
+  bool tryPush(std::string_view str) {
+    uint64_t pos = head.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot &s = slots[pos & (CAPACITY - 1)];
+      int64_t dif = (int64_t)s.seq.load(std::memory_order_acquire) - (int64_t)pos;
+      if (dif == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          s.s = str;
+          s.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (dif < 0) {
+        return false; // the slot still holds a string from a lap ago
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // pop from the ring: false if it is empty
+  bool tryPop(std::string_view *str) {
+    uint64_t pos = tail.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot &s = slots[pos & (CAPACITY - 1)];
+      int64_t dif = (int64_t)s.seq.load(std::memory_order_acquire) - (int64_t)(pos + 1);
+      if (dif == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          *str = s.s;
+          s.seq.store(pos + CAPACITY, std::memory_order_release);
+          return true;
+        }
+      } else if (dif < 0) {
+        return false; // the slot has not been written yet
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // pop from the ring, or else the overflow list
+  bool tryTake(std::string_view *str) {
+    if (tryPop(str)) {
+      queued--;
+      return true;
+    }
+    if (overflowSize.load() == 0)
+      return false;
+    auto lock = crawlStats.lock(m, crawlStats.queueLock);
+    if (overflow.empty())
+      return false;
+    *str = overflow.front();
+    overflow.pop_front();
+    overflowSize--;
+    queued--;
+    return true;
+  }
+
+  // wake sleeping callers of get_next()
+  void wake(int n) {
+    epoch.fetch_add(1);
+    if (sleepers.load() > 0)
+      syscall(SYS_futex, &epoch, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+  }
+
+  /**
+   * @brief Pushes a copy of a string to the back of the queue
+   * 
+   * @param s The string to be pushed
+   * @return void
+  */
+  void push_back(std::string s) {
+    push_stable(names.name(names.intern(s)));
+  }
+
+  /**
+   * @brief Pushes a string to the back of the queue without copying it
+   * 
+   * @param s The string to be pushed, which must not change or go until it
+   * has been popped
+   * @return void
+  */
+  void push_stable(std::string_view s) {
+    pending++;
+    queued++;
+    if (!tryPush(s)) {
+      auto lock = crawlStats.lock(m, crawlStats.queueLock);
+      overflow.push_back(s);
+      overflowSize++;
+    }
+    if (crawlStats.enabled)
+      crawlStats.sampleDepth(queued.load());
+    wake(1);
+  }
+
+  /**
+   * @brief Pops a string from the front of the queue, without waiting
+   * 
+   * @return std::string The string that was popped, or "" if the queue is empty
+  */
+  std::string pop_front() {
+    std::string_view s;
+    if (!tryTake(&s))
+      return "";
+    return std::string(s);
+  }
+
+  /**
+   * @brief Forgets the strings interned so far, so that a long-lived queue
+   * holds only those of its current crawl; only for an empty queue that no
+   * thread is using
+   * 
+   * @return void
+  */
+  void clear() {
+    names.clear();
+  }
+
+  /**
+   * @brief Returns the size of the queue
+   * 
+   * @return size_t The size of the queue
+  */
+  size_t size() {
+    return queued.load();
+  }
+
+  /**
+   * @brief Returns the next string in the queue, waiting for one if the queue
+   * is empty but some string popped earlier is not done() yet (as processing
+   * it may push more)
+   * 
+   * @return std::string The next string in the queue, or "" once every string
+   * pushed is done
+  */
+  std::string get_next() {
+    for (;;) {
+      uint32_t e = epoch.load();
+      std::string_view s;
+      if (tryTake(&s)) {
+        if (crawlStats.enabled)
+          crawlStats.sampleDepth(queued.load());
+        return std::string(s);
+      }
+      if (pending.load() == 0)
+        return "";
+      // sleep unless something was pushed (or finished) since e was read
+      uint64_t t0 = myStats ? nowNs() : 0;
+      sleepers++;
+      syscall(SYS_futex, &epoch, FUTEX_WAIT_PRIVATE, e, NULL, NULL, 0);
+      sleepers--;
+      if (myStats)
+        myStats->queueWaitNs += nowNs() - t0;
+    }
+  }
+
+  /**
+   * @brief Marks a string from get_next() as finished with; after the last
+   * one, every waiting get_next() returns ""
+   * 
+   * @return void
+  */
+  void done() {
+    if (pending.fetch_sub(1) == 1)
+      wake(INT_MAX);
+  }
+};
+
+// a file's list of dependencies, allocated from its table's arena
+typedef std::pmr::list<std::pmr::string> DepList;
+
+/**
+ * @brief A concurrent map of strings to lists of strings
+ * 
+ * The map's nodes, every list's nodes and the strings in both (keys and
+ * names longer than fit in a string itself) come from arena, which keeps a
+ * pool per thread, so the threads filling lists do not contend on the global
+ * heap and release() gives it all back at once. A list built for the table
+ * must use arena too (see resource()), so that it can be swapped in; a
+ * std::string is looked up through key(), which copies it into arena.
+*/
+struct ConcMap
+{
+  std::pmr::synchronized_pool_resource arena;
+  std::pmr::unordered_map<std::pmr::string, DepList> theTable{&arena};
+  std::mutex m;
+
+  std::pmr::memory_resource *resource() {
+    return &arena;
+  }
+
+  // a string as a key of theTable
+  std::pmr::string key(const std::string &s) {
+    return std::pmr::string(s, &arena);
+  }
+
+  /**
+   * @brief Returns the list of strings associated with a key
+   * 
+   * @param s The key
+   * @return DepList* Pointer to the list of strings associated with the key
+  */
+  auto get(std::string s) {
+    std::pmr::string k = key(s);
+    auto lock = crawlStats.lock(m, crawlStats.mapLock);
+    return &theTable[k];
+  }
+
+  /**
+   * @brief Returns an iterator to the element with the given key
+   * 
+   * @param s The key
+   * @return An iterator to the element with the given key
+  */
+  auto find(std::string s) {
+    std::pmr::string k = key(s);
+    auto lock = crawlStats.lock(m, crawlStats.mapLock);
+    return theTable.find(k);
+  }
+
+  /**
+   * @brief Returns an iterator to the beginning of the map
+   * 
+   * @return An iterator to the beginning of the map
+  */
+  auto end() {
+    auto lock = crawlStats.lock(m, crawlStats.mapLock);
+    return theTable.end();
+  }
+
+  /**
+   * @brief Inserts a key-value pair into the map
+   * 
+   * @param p The key-value pair
+   * @return An iterator to the inserted element
+  */
+  auto insert(std::pair<std::string, DepList> p) {
+    auto lock = crawlStats.lock(m, crawlStats.mapLock);
+    return theTable.emplace(key(p.first), std::move(p.second));
+  }
+
+  /**
+   * @brief Empties the map and returns its memory, in one go
+   * 
+   * @return void
+  */
+  void release() {
+    auto lock = crawlStats.lock(m, crawlStats.mapLock);
+    // nodes go back to the pools, cheaply, then the pools to the heap (an
+    // empty map holds no memory of the arena)
+    std::pmr::unordered_map<std::pmr::string, DepList>(&arena).swap(theTable);
+    arena.release();
+  }
+
+  /**
+   * @brief Appends a string to the list of a key, unless already there
+   * 
+   * @param key The key
+   * @param s The string to append
+   * @return void
+  */
+  void appendUnique(const std::string &key, const std::string &s) {
+    std::pmr::string k = this->key(key);
+    auto lock = crawlStats.lock(m, crawlStats.mapLock);
+    auto &ll = theTable[k];
+    for (auto &x : ll)
+      if (std::string_view(x) == s)
+        return;
+    ll.emplace_back(s);
+  }
+};
+
+#endif
@@ -7,10 +7,19 @@
  * - NOTE: After doing my report, I check if everything works before submitting.
  * I just found out that sometimes it can print in a different order than it is in
  * the file output. However, the output is still correct.
+ * (Since fixed: a header found by two threads at once could be queued and
+ * processed twice, with both appending to its list. Now each file is queued
+ * once and its list filled by one thread, in source order, so the output is
+ * the sequential version's at any CRAWLER_THREADS.)
 */
 
 /*
- * usage: ./dependencyDiscoverer [-Idir] ... file.c|file.l|file.y ...
+ * usage: ./dependencyDiscoverer [-MMD] [--conditional] [--grammar] [-Dname[=value]] [-Uname] [-Idir] ...
+ *                               file.c|file.l|file.y ...
+ *        ./dependencyDiscoverer -Rchanged.h ... [-Idir] ... file.c|file.l|file.y ...
+ *        ./dependencyDiscoverer --compdb=compile_commands.json [--conditional] [-D...] [-U...] [-Idir] ...
+ *        ./dependencyDiscoverer --server=socket [--conditional] [-D...] [-U...] [-Idir] ...
+ *        ./dependencyDiscoverer --client=socket file.c|file.l|file.y ...
  *
  * processes the c/yacc/lex source file arguments, outputting the dependencies
  * between the corresponding .o file, the .c source file, and any included
@@ -25,7 +34,8 @@
  *
  *                  foo.o: foo.c inc1.h inc2.h inc3.h
  *
- * note that system includes (i.e. those in angle brackets) are NOT processed
+ * note that system includes (i.e. those in angle brackets) are NOT processed,
+ * unless CRAWLER_SYSINDEX is set (see below)
  *
  * dependencyDiscoverer uses the CPATH environment variable, which can contain a
  * set of directories separated by ':' to find included files
@@ -42,15 +52,83 @@
  *      foo/bar/include/x.h
  *      /home/user/include/x.h
  *      /usr/local/group/include/x.h
+ *
+ * with --grammar, the .y and .l arguments are treated as yacc and lex input:
+ * only their C code (the %{ ... %} blocks and what follows the second %%) is
+ * scanned; the files made from them (y.tab.h, y.tab.c, gram.tab.h and
+ * gram.tab.c for gram.y; lex.yy.c for a .l) are not reported as missing
+ * before they are made, and the C ones depend on their grammars, whose code
+ * they hold; for example, if gram.y includes lex.yy.c
+ *
+ *                  gram.o: gram.y lex.yy.c scan.l mem.h
+ *
+ * with --compdb=compile_commands.json, the translation units of a compilation
+ * database are crawled instead of file arguments, each with the search path
+ * made by its own -iquote and -I flags (and, with --conditional, its own -D
+ * and -U flags) followed by the command line's -I directories and CPATH; see
+ * CompDb
+ *
+ * if the CRAWLER_CACHE environment variable names a file, the direct includes
+ * found in each file are saved there, keyed by the file's path, size, mtime
+ * and content hash; on later runs only files that changed are rescanned
+ *
+ * if the CRAWLER_SYSINDEX environment variable names a file, #include <x.h>
+ * lines are followed too, through an index of the system directories kept in
+ * that file (see SysIndex); the system directories are taken from
+ * CRAWLER_SYSDIRS, separated by ':' like CPATH, and default to those
+ * "cc -E -v" lists (with the multiarch directory and the compiler's own), or
+ * "/usr/local/include:/usr/include" if it cannot be run; system headers are listed by their full path, for example
+ *
+ *                  foo.o: foo.c inc1.h /usr/include/stdio.h ...
+ *
+ * the index is built on the first run and whenever a system directory
+ * changes, and refreshed after a run that reached an edited header, so upgrading the toolchain's headers changes the
+ * dependencies
+ *
+ * with -Rx.h (which may be repeated) the output is instead, for each changed
+ * file x.h, the objects of the file arguments that depend on it, directly or
+ * not, which are the ones to rebuild when it changes; for example
+ *
+ *                  inc3.h: foo.o
+ *
+ * x.h may be spelled as it is included, as a path to the file, or as a name
+ * on the search path; a file that no file argument includes is an error
+ *
+ * if CRAWLER_REPORT names a file, a JSON report of the include graph is
+ * written there (see writeReport()): its include cycles, the largest of them,
+ * and the CRAWLER_REPORT_TOP (default 10) headers that the most objects
+ * depend on, which are the ones whose change recompiles the most
+ *
+ * the work is shared by CRAWLER_THREADS threads (default 2; 0 means none,
+ * doing everything in the main thread) from a ThreadPool (see threadpool.h),
+ * which CRAWLER_AFFINITY=compact|scatter pins to CPUs and NUMA nodes and
+ * CRAWLER_IDLE=spin keeps polling for work instead of sleeping
+ *
+ * if CRAWLER_PREFETCH is a positive number, that many extra threads open each
+ * newly found header and start reading it as soon as it is queued (see
+ * Prefetcher), which helps on a cold page cache or a network file system
+ *
+ * if CRAWLER_PROCS is a positive number, the crawl is done by that many
+ * worker processes instead, sharing the work and the graph through a shared
+ * memory segment of CRAWLER_SHM_MB megabytes (default 1024; see SharedCrawl);
+ * a worker that crashes costs only the dependencies of the file it was on
+ *
+ * with CRAWLER_ENGINE=coro (in a C++20 build, see "make coro") each file is
+ * crawled by a coroutine instead (see CoroCrawl): CRAWLER_THREADS threads
+ * (default one per core) scan files while CRAWLER_CORO_IO threads (default
+ * 64) open them and start their reads, so up to 256 reads are in flight
+ * without a thread each; the opens themselves are still a thread pool's
  */
 
 /*
  * general design of main()
  * ========================
- * There are three globally accessible variables:
+ * The state of a crawl is held by a DependencyGraph, chiefly:
  * - dirs: a vector storing the directories to search for headers
  * - theTable: a hash table mapping file names to a list of dependent file names
  * - workQ: a list of file names that have to be processed
+ * so several can be crawled in one process, and one kept between crawls is
+ * brought up to date by rescanning only the files that changed (update())
  *
  * 1. look up CPATH in environment
  * 2. assemble dirs vector from ".", any -Idir flags, and fields in CPATH
@@ -63,39 +141,50 @@
  * 4. for each file on the workQ
  *    a. lookup list of dependencies
  *    b. invoke process(name, list_of_dependencies)
+ * 4.6. freeze the table into an IdGraph (the server keeps both, and after
+ *    each query's update() redoes only the rows that changed)
  * 5. for each file argument (after -Idir flags)
- *    a. create a hash table in which to track file names already printed
- *    b. create a linked list to track dependencies yet to print
- *    c. print "foo.o:", insert "foo.o" into hash table
- *       and append "foo.o" to linked list
- *    d. invoke printDependencies()
+ *    a. start a new walk, in which no file is marked printed yet
+ *    b. empty the walk's queue of dependencies yet to print
+ *    c. print "foo.o:", mark "foo.o" and queue it
+ *    d. print the dependencies as in printFrozen()
  *
  * general design for process()
  * ============================
  *
  * 1. open the file
- * 2. for each line of the file
- *    a. skip leading whitespace
+ *    a. if the same file (by device and inode, see FileIds) was already read
+ *       under another spelling, take its list of included file names; or if
+ *       CRAWLER_CACHE is set and the file's size and mtime match its cache
+ *       entry, take the list of included file names from the cache
+ *    b. otherwise map the file into memory; if its content hash matches the
+ *       cache entry, take the list from the cache, else scan it as in 2
+ *    c. for each included file name, carry out the last three steps of 2b-ii
+ * 2. for each '#' in the mapping (found with memchr)
+ *    a. skip it unless only whitespace precedes it on its line
  *    b. if match "#include"
- *       i. skip leading whitespace
+ *       i. skip leading whitespace (without leaving the line)
  *       ii. if next character is '"'
- *           * collect remaining characters of file name (up to '"')
+ *           * collect remaining characters of file name (up to '"' or end of line)
  *           * append file name to dependency list for this open file
- *           * if file name not already in the master Table
+ *           * if file name not already in the master Table (checked and
+ *             inserted in one step, so each file is queued exactly once)
  *             - insert mapping from file name to empty list in master table
  *             - append file name to workQ
- * 3. close file
+ *    c. continue the search from the end of the line
+ *    d. with --conditional or a cache, note the file's include guard
+ * 3. unmap the file
  *
- * general design for printDependencies()
- * ======================================
+ * general design for printFrozen()
+ * ===============================
  *
- * 1. while there is still a file in the toProcess linked list
+ * 1. while there is still a file in the toProcess queue
  * 2. fetch next file from toProcess
- * 3. lookup up the file in the master table, yielding the linked list of dependencies
- * 4. iterate over dependenceies
- *    a. if the filename is already in the printed hash table, continue
+ * 3. look up the file's row in the frozen graph, yielding its dependencies
+ * 4. iterate over dependencies
+ *    a. if the file, under any spelling, is already marked printed, continue
  *    b. print the filename
- *    c. insert into printed
+ *    c. mark it printed
  *    d. append to toProcess
  *
  * Additional helper functions
@@ -104,410 +193,5143 @@
  * dirName() - appends trailing '/' if needed
  * parseFile() - breaks up filename into root and extension
  * openFile()  - attempts to open a filename using the search path defined by the dirs vector.
+ *               Each search directory is listed once (see DirCache), and only
+ *               directories whose listing contains the file are tried, so
+ *               headers are found without any failed open() calls.
+ * scanIncludes() - finds the #include "foo.h" lines in a mapped file
+ * forEachDirective() - finds every preprocessor line in a mapped file
+ * detectGuard() - finds a header's include guard macro or #pragma once
+ * scanConditional() - like scanIncludes(), but skips groups that are not taken
+ * closeFacts() - finds the macros a header, and every header it reaches, may change
+ * hashBytes() - hashes file contents for the on-disk cache (see DepCache)
+ * addSystemHeader() - adds a system header's closure from the SysIndex to the table
+ * tarjan() - finds the strongly connected components of the include graph (see IdGraph)
+ * writeReport() - reports include cycles and the headers with the most dependents
+ * reverseReach() - finds every file that depends on a changed file, for -R
+ * splitCommand() - splits a compilation database command into words
  */
 
 #include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
+#include <set>
 #include <list>
+#include <deque>
+#include <memory>
+#include <memory_resource>
+#include <algorithm>
 
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <future>
 #include <chrono>
 #include <thread>
 
+#include "threadpool.h"
+#include "concurrent.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define CRAWLER_COROUTINES 1
+#endif
+
 #define CRAWLER_THREADS_DEFAULT 2
 
 /**
- * @brief A concurrent queue of strings
+ * @brief A cache of directory listings, shared by all threads
+ * 
+ * Each directory is read once with readdir() (getdents underneath) and its
+ * entry names kept in a hash set. A listing remembers the directory's mtime so
+ * that long running callers can drop stale listings with revalidate().
 */
-struct ConcQueue
+struct DirCache
 {
-  std::list<std::string> queue;
+  struct Listing {
+    bool exists = false;
+    struct timespec mtime = {0, 0};
+    std::unordered_set<std::string> entries;
+  };
+  std::unordered_map<std::string, std::shared_ptr<const Listing>> listings;
   std::mutex m;
 
   /**
-   * @brief Pushes a string to the back of the queue
-   * 
-   * @param s The string to be pushed
-   * @return void
-  */
-  void push_back(std::string s) {
-    std::unique_lock<std::mutex> lock(m);
-    queue.push_back(s);
-  }
-
-  /**
-   * @brief Pops a string from the front of the queue
+   * @brief Reads a directory (a missing one gives an empty listing)
    * 
-   * @return std::string The string that was popped
+   * @param dir The directory path
+   * @return std::shared_ptr<const Listing> The new listing
   */
-  std::string pop_front() {
-    std::unique_lock<std::mutex> lock(m);
-    if (!queue.empty()) {
-      auto s = queue.front();
-      queue.pop_front();
-      return s;
+  static std::shared_ptr<const Listing> load(const std::string &dir) {
+    auto l = std::make_shared<Listing>();
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL)
+      return l;
+    struct stat st;
+    if (fstat(dirfd(d), &st) == 0) {
+      l->exists = true;
+      l->mtime = st.st_mtim;
     }
-    return "";
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+      l->entries.insert(e->d_name);
+    }
+    closedir(d);
+    return l;
   }
 
   /**
-   * @brief Returns the string at the front of the queue
+   * @brief Checks whether a directory has an entry, listing it on first use
    * 
-   * @return std::string The string at the front of the queue
+   * @param dir The directory, with a trailing '/'
+   * @param name The entry name, which may contain further '/' separated parts
+   * @return bool True if the entry exists
   */
-  std::string front() {
-    std::unique_lock<std::mutex> lock(m);
-    if (!queue.empty()) {
-      return queue.front();
+  bool contains(const std::string &dir, const std::string &name) {
+    std::string::size_type slash = name.rfind('/');
+    std::string path = dir;
+    std::string base = name;
+    if (slash != std::string::npos) {
+      path += name.substr(0, slash + 1);
+      base = name.substr(slash + 1);
     }
-    return "";
+    std::shared_ptr<const Listing> l;
+    {
+      std::unique_lock<std::mutex> lock(m);
+      auto it = listings.find(path);
+      if (it != listings.end())
+        l = it->second;
+    }
+    if (!l) {
+      // read the directory without holding the lock; if another thread got
+      // there first its listing is kept
+      auto fresh = load(path);
+      std::unique_lock<std::mutex> lock(m);
+      l = listings.emplace(path, fresh).first->second;
+    }
+    return l->entries.count(base) > 0;
   }
 
   /**
-   * @brief Returns the size of the queue
+   * @brief Checks whether a path has come or gone since its directory was
+   * listed
    * 
-   * @return size_t The size of the queue
+   * @param path The path, a directory with a trailing '/' and an entry name
+   * @param exists Whether it exists now
+   * @return bool True if the listing says otherwise (false if the directory
+   * was never listed, as then no name was looked for in it)
   */
-  size_t size() {
+  bool stale(const std::string &path, bool exists) {
+    std::string::size_type slash = path.rfind('/');
+    if (slash == std::string::npos)
+      return false;
     std::unique_lock<std::mutex> lock(m);
-    return queue.size();
+    auto it = listings.find(path.substr(0, slash + 1));
+    return it != listings.end() && (it->second->entries.count(path.substr(slash + 1)) > 0) != exists;
   }
 
   /**
-   * @brief Returns the next string in the queue
+   * @brief Drops every listing whose directory has changed since it was read
    * 
-   * @return std::string The next string in the queue or an empty string if the queue is empty
+   * @return void
   */
-  std::string get_next() {
+  void revalidate() {
     std::unique_lock<std::mutex> lock(m);
-    if (!queue.empty()) {
-      auto s = queue.front();
-      queue.pop_front();
-      return s;
-    } else {
-      return "";
+    for (auto it = listings.begin(); it != listings.end(); ) {
+      struct stat st;
+      bool exists = stat(it->first.c_str(), &st) == 0;
+      const Listing &l = *it->second;
+      if (exists != l.exists || (exists &&
+          (st.st_mtim.tv_sec != l.mtime.tv_sec || st.st_mtim.tv_nsec != l.mtime.tv_nsec)))
+        it = listings.erase(it);
+      else
+        ++it;
     }
   }
 };
 
+DirCache dirCache;
+int coroIoThreads = 0; // with CRAWLER_ENGINE=coro, the threads reading files
+
+std::string dirName(const char * c_str) {
+  std::string s = c_str; // s takes ownership of the string content by allocating memory for it
+  if (s.empty()) { s = "."; } // an empty search path entry means the current directory
+  if (s.back() != '/') { s += '/'; }
+  return s;
+}
+
+std::pair<std::string, std::string> parseFile(const char* c_file) {
+  std::string file = c_file;
+  std::string::size_type pos = file.rfind('.');
+  if (pos == std::string::npos) {
+    return {file, ""};
+  } else {
+    return {file.substr(0, pos), file.substr(pos + 1)};
+  }
+}
+
+// open file using a directory search path, as constructed in main()
+static int openFile(const std::vector<std::string> &dirs, const char *file, std::string *opened) {
+  for (unsigned int i = 0; i < dirs.size(); i++) {
+    if (!dirCache.contains(dirs[i], file))
+      continue; // not in this directory, so don't even try
+    std::string path = dirs[i] + file;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      *opened = path;
+      return fd; // return the first file that successfully opens
+    }
+  }
+  return -1;
+}
+
+static uint64_t hashBytes(const char *p, size_t n) {
+  uint64_t h = 0xcbf29ce484222325ULL ^ n;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0x100000001b3ULL;
+    h ^= h >> 32;
+  }
+  for (; i < n; i++) {
+    h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static int64_t mtimeNs(const struct stat &st) {
+  return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
 /**
- * @brief A concurrent map of strings to lists of strings
+ * @brief The on-disk cache of each file's direct includes
+ * 
+ * Entries are keyed by the path a file was opened through. An entry is trusted
+ * when the file's size and mtime are unchanged; when only the mtime differs the
+ * content hash decides. The config hash identifies the -D/-U/--conditional
+ * flags the lists were made with; a cache made with other flags is ignored.
+ * The file format is line based:
+ * 
+ *   dependencyDiscoverer-cache 2 config
+ *   path<TAB>size<TAB>mtime_ns<TAB>hash<TAB>count<TAB>guard
+ *   ...count lines of included file names...
+ * 
+ * where guard is the file's include guard (see detectGuard()), or empty.
 */
-struct ConcMap
+struct DepCache
 {
-  std::unordered_map<std::string, std::list<std::string>> theTable;
+  struct Entry {
+    int64_t size = -1;
+    int64_t mtime = 0;
+    uint64_t hash = 0;
+    std::vector<std::string> includes;
+    std::string guard;
+    bool seen = false; // looked up in this run
+  };
+  std::unordered_map<std::string, Entry> entries;
   std::mutex m;
+  bool enabled = false;
+  bool dirty = false;
+  uint64_t config = 0;
+  bool journaling = false;         // note each entry changed, for takeJournal()
+  std::vector<std::string> journal; // the paths of the entries changed since
+
+  /**
+   * @brief Reads entries in the file's format, after its first line
+   * 
+   * @param fd Where to read them from
+   * @param fresh Whether they were made in this run, so are to be saved
+   * @return bool False if they were malformed
+  */
+  bool readEntries(FILE *fd, bool fresh) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    bool ok = true;
+    while (ok && (len = getline(&line, &cap, fd)) > 0) {
+      if (line[len - 1] != '\n') { ok = false; break; }
+      line[len - 1] = '\0';
+      char *tab = strchr(line, '\t');
+      Entry e;
+      unsigned long count;
+      if (tab == NULL ||
+          sscanf(tab + 1, "%" SCNd64 "\t%" SCNd64 "\t%" SCNx64 "\t%lu",
+                 &e.size, &e.mtime, &e.hash, &count) != 4) {
+        ok = false;
+        break;
+      }
+      std::string path(line, tab);
+      char *guard = tab + 1;
+      for (int f = 0; f < 4 && guard != NULL; f++)
+        guard = strchr(guard + 1, '\t');
+      if (guard != NULL)
+        e.guard = guard + 1;
+      for (unsigned long i = 0; i < count; i++) {
+        if ((len = getline(&line, &cap, fd)) <= 0 || line[len - 1] != '\n') {
+          ok = false;
+          break;
+        }
+        e.includes.emplace_back(line, len - 1);
+      }
+      e.seen = fresh;
+      dirty |= fresh;
+      entries[path] = std::move(e);
+    }
+    free(line);
+    return ok;
+  }
+
+  // write one entry in the file's format
+  static void writeEntry(FILE *fd, const std::string &path, const Entry &e) {
+    fprintf(fd, "%s\t%" PRId64 "\t%" PRId64 "\t%" PRIx64 "\t%zu\t%s\n", path.c_str(),
+            e.size, e.mtime, e.hash, e.includes.size(), e.guard.c_str());
+    for (auto &inc : e.includes)
+      fprintf(fd, "%s\n", inc.c_str());
+  }
 
   /**
-   * @brief Returns the list of strings associated with a key
+   * @brief Returns the entries changed since the last call, in the file's
+   * format, and forgets which they were; with journaling, so that a worker
+   * process can hand them to the parent (see SharedCrawl)
    * 
-   * @param s The key
-   * @return std::list<std::string>* Pointer to the list of strings associated with the key
+   * @return std::string The entries, for readEntries()
   */
-  auto get(std::string s) {
+  std::string takeJournal() {
     std::unique_lock<std::mutex> lock(m);
-    return &theTable[s];
+    char *text = NULL;
+    size_t len = 0;
+    FILE *fd = open_memstream(&text, &len);
+    for (auto &path : journal)
+      writeEntry(fd, path, entries[path]);
+    fclose(fd);
+    std::string out(text, len);
+    free(text);
+    journal.clear();
+    return out;
+  }
+
+  /**
+   * @brief Loads the cache file; a missing or malformed file gives an empty cache
+   * 
+   * @param file The cache file
+   * @return void
+  */
+  void load(const char *file) {
+    enabled = true;
+    FILE *fd = fopen(file, "r");
+    if (fd == NULL)
+      return;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    uint64_t cfg;
+    bool ok = (len = getline(&line, &cap, fd)) > 0 &&
+              sscanf(line, "dependencyDiscoverer-cache 2 %" SCNx64, &cfg) == 1;
+    free(line);
+    if (ok && cfg != config) {
+      // made with other flags, so start again
+      fclose(fd);
+      return;
+    }
+    ok = ok && readEntries(fd, false);
+    fclose(fd);
+    if (!ok) {
+      fprintf(stderr, "Ignoring malformed cache %s\n", file);
+      entries.clear();
+    }
+  }
+
+  /**
+   * @brief Writes the cache back if anything changed, replacing the old file
+   * atomically; entries for files that have since disappeared are dropped
+   * 
+   * @param file The cache file
+   * @return void
+  */
+  void save(const char *file) {
+    if (!enabled || !dirty)
+      return;
+    std::string tmp = std::string(file) + ".tmp" + std::to_string(getpid());
+    FILE *fd = fopen(tmp.c_str(), "w");
+    if (fd == NULL) {
+      fprintf(stderr, "Error writing %s\n", tmp.c_str());
+      return;
+    }
+    fprintf(fd, "dependencyDiscoverer-cache 2 %" PRIx64 "\n", config);
+    for (auto &p : entries) {
+      struct stat st;
+      if (!p.second.seen && stat(p.first.c_str(), &st) != 0)
+        continue;
+      writeEntry(fd, p.first, p.second);
+    }
+    if (fclose(fd) != 0 || rename(tmp.c_str(), file) != 0) {
+      fprintf(stderr, "Error writing %s\n", file);
+      unlink(tmp.c_str());
+    }
   }
 
   /**
-   * @brief Returns an iterator to the element with the given key
+   * @brief Looks up a file whose size and mtime are known
    * 
-   * @param s The key
-   * @return An iterator to the element with the given key
+   * @param path The path the file was opened through
+   * @param st The file's current status
+   * @param includes Filled with the cached includes on a hit
+   * @param guard Filled with the cached include guard on a hit
+   * @return bool True if the entry is still valid by size and mtime
   */
-  auto find(std::string s) {
+  template <typename Includes>
+  bool lookup(const std::string &path, const struct stat &st,
+              Includes *includes, std::string *guard) {
     std::unique_lock<std::mutex> lock(m);
-    return theTable.find(s);
+    auto it = entries.find(path);
+    if (it == entries.end())
+      return false;
+    it->second.seen = true;
+    if (it->second.size != st.st_size || it->second.mtime != mtimeNs(st))
+      return false;
+    includes->assign(it->second.includes.begin(), it->second.includes.end());
+    *guard = it->second.guard;
+    return true;
   }
 
   /**
-   * @brief Returns an iterator to the beginning of the map
+   * @brief Looks up a file by content hash, refreshing its mtime on a hit
    * 
-   * @return An iterator to the beginning of the map
+   * @param path The path the file was opened through
+   * @param st The file's current status
+   * @param hash The hash of the file's content
+   * @param includes Filled with the cached includes on a hit
+   * @param guard Filled with the cached include guard on a hit
+   * @return bool True if the content is unchanged
   */
-  auto end() {
+  template <typename Includes>
+  bool lookup(const std::string &path, const struct stat &st, uint64_t hash,
+              Includes *includes, std::string *guard) {
     std::unique_lock<std::mutex> lock(m);
-    return theTable.end();
+    auto it = entries.find(path);
+    if (it == entries.end() || it->second.size != st.st_size || it->second.hash != hash)
+      return false;
+    it->second.mtime = mtimeNs(st);
+    dirty = true;
+    if (journaling)
+      journal.push_back(path);
+    includes->assign(it->second.includes.begin(), it->second.includes.end());
+    *guard = it->second.guard;
+    return true;
   }
 
   /**
-   * @brief Inserts a key-value pair into the map
+   * @brief Records the includes of a freshly scanned file
    * 
-   * @param p The key-value pair
-   * @return An iterator to the inserted element
+   * @param path The path the file was opened through
+   * @param st The file's status
+   * @param hash The hash of the file's content
+   * @param includes The included file names, in source order
+   * @param guard The file's include guard
+   * @return void
   */
-  auto insert(std::pair<std::string, std::list<std::string>> p) {
+  template <typename Includes>
+  void update(const std::string &path, const struct stat &st, uint64_t hash,
+              const Includes &includes, const std::string &guard) {
+    if (path.find_first_of("\t\n") != std::string::npos)
+      return; // cannot be represented in the file format
     std::unique_lock<std::mutex> lock(m);
-    return theTable.insert(p);
+    Entry &e = entries[path];
+    e.size = st.st_size;
+    e.mtime = mtimeNs(st);
+    e.hash = hash;
+    e.includes.assign(includes.begin(), includes.end());
+    e.guard = guard;
+    e.seen = true;
+    dirty = true;
+    if (journaling)
+      journal.push_back(path);
   }
 };
 
-std::vector<std::string> dirs;
-//std::unordered_map<std::string, std::list<std::string>> theTable;
-//std::list<std::string> workQ;
-ConcMap theTable;
-ConcQueue workQ;
+DepCache depCache;
 
-std::string dirName(const char * c_str) {
-  std::string s = c_str; // s takes ownership of the string content by allocating memory for it
-  if (s.back() != '/') { s += '/'; }
-  return s;
-}
+/**
+ * @brief A read-only mapping of a whole file, unmapped on destruction
+*/
+struct MappedFile
+{
+  const char *data = nullptr;
+  size_t size = 0;
 
-std::pair<std::string, std::string> parseFile(const char* c_file) {
-  std::string file = c_file;
-  std::string::size_type pos = file.rfind('.');
-  if (pos == std::string::npos) {
-    return {file, ""};
-  } else {
-    return {file.substr(0, pos), file.substr(pos + 1)};
+  /**
+   * @brief Maps the file behind an open descriptor
+   * 
+   * @param fd The descriptor, which may be closed once this returns
+   * @param length The size of the file
+   * @return bool True on success (an empty file maps to a null buffer)
+  */
+  bool map(int fd, size_t length) {
+    size = length;
+    if (size == 0)
+      return true;
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      size = 0;
+      return false;
+    }
+    madvise(p, size, MADV_SEQUENTIAL);
+    data = (const char *)p;
+    return true;
   }
-}
 
-// open file using the directory search path constructed in main()
-static FILE *openFile(const char *file) {
-  FILE *fd;
-  for (unsigned int i = 0; i < dirs.size(); i++) {
-    std::string path = dirs[i] + file;
-    fd = fopen(path.c_str(), "r");
-    if (fd != NULL)
-      return fd; // return the first file that successfully opens
+  ~MappedFile() {
+    if (data)
+      munmap((void *)data, size);
   }
-  return NULL;
+};
+
+static inline bool isBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r';
 }
 
-// process file, looking for #include "foo.h" lines
-static void process(const char *file, std::list<std::string> *ll) {
-  char buf[4096], name[4096];
-  // 1. open the file
-  FILE *fd = openFile(file);
-  if (fd == NULL) {
-    fprintf(stderr, "Error opening %s\n", file);
-    //exit(-1);
-    return;
-  }
-  while (fgets(buf, sizeof(buf), fd) != NULL) {
-    char *p = buf;
-    // 2a. skip leading whitespace
-    while (isspace((int)*p)) { p++; }
-    // 2b. if match #include 
-    if (strncmp(p, "#include", 8) != 0) { continue; }
-    p += 8; // point to first character past #include
-    // 2bi. skip leading whitespace
-    while (isspace((int)*p)) { p++; }
-    if (*p != '"') { continue; }
-    // 2bii. next character is a "
-    p++; // skip "
-    // 2bii. collect remaining characters of file name
-    char *q = name;
-    while (*p != '\0') {
-      if (*p == '"') { break; }
-      *q++ = *p++;
-    }
-    *q = '\0';
-    // 2bii. append file name to dependency list
-    ll->push_back( {name} );
-    // 2bii. if file name not already in table ...
-    if (theTable.find(name) != theTable.end()) { continue; }
-    // ... insert mapping from file name to empty list in table ...
-    theTable.insert( { name, {} } );
-    // ... append file name to workQ
-    workQ.push_back( name );
-    
-    //printf("%s%zu\n", ("Added " + std::string(name) + " to workQ -> ").c_str(), workQ.size());
-  }
-  // 3. close file
-  fclose(fd);
-}
-
-// iteratively print dependencies
-static void printDependencies(std::unordered_set<std::string> *printed,
-                              std::list<std::string> *toProcess,
-                              FILE *fd) {
-  if (!printed || !toProcess || !fd) return;
-
-  // 1. while there is still a file in the toProcess list
-  while ( toProcess->size() > 0 ) {
-    // 2. fetch next file to process
-    std::string name = toProcess->front();
-    toProcess->pop_front();
-    // 3. lookup file in the table, yielding list of dependencies
-    std::list<std::string> *ll = theTable.get(name);
-    // 4. iterate over dependencies
-    for (auto iter = ll->begin(); iter != ll->end(); iter++) {
-      // 4a. if filename is already in the printed table, continue
-      if (printed->find(*iter) != printed->end()) { continue; }
-      // 4b. print filename
-      fprintf(fd, " %s", iter->c_str());
-      // 4c. insert into printed
-      printed->insert( *iter );
-      // 4d. append to toProcess
-      toProcess->push_back( *iter );
+/**
+ * @brief Finds every #include "foo.h" line in a buffer
+ * 
+ * Only lines whose first non-blank character is '#' are looked at, and those
+ * are found by jumping between '#' characters with memchr, so lines can be
+ * of any length.
+ * 
+ * @param buf The start of the buffer
+ * @param size The length of the buffer
+ * @param found Called with each included file name, in source order
+ * @param angle Also report #include <foo.h> lines, as "<foo.h>"
+ * @return void
+*/
+template <typename Callback>
+static void scanIncludes(const char *buf, size_t size, Callback found, bool angle) {
+  const char *end = buf + size;
+  const char *p = buf;
+  while (p < end && (p = (const char *)memchr(p, '#', end - p)) != NULL) {
+    // 2a. only whitespace may precede the '#' on its line
+    const char *b = p;
+    while (b > buf && isBlank(b[-1])) { b--; }
+    if (b > buf && b[-1] != '\n') { p++; continue; }
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    if (eol == NULL) { eol = end; }
+    // 2b. if match #include
+    if (eol - p >= 8 && memcmp(p, "#include", 8) == 0) {
+      const char *q = p + 8; // point to first character past #include
+      // 2bi. skip leading whitespace
+      while (q < eol && isBlank(*q)) { q++; }
+      // 2bii. next character is a "
+      if (q < eol && *q == '"') {
+        q++; // skip "
+        // 2bii. collect remaining characters of file name
+        const char *close = (const char *)memchr(q, '"', eol - q);
+        found(std::string(q, close ? close : eol));
+      } else if (angle && q < eol && *q == '<') {
+        const char *close = (const char *)memchr(q, '>', eol - q);
+        if (close != NULL)
+          found(std::string(q, close + 1));
+      }
     }
+    // 2c. carry on from the end of the line
+    p = eol;
   }
 }
 
 /**
- * @brief The function that each thread will execute. 
- * It will make step 4 of the main function.
+ * @brief An index of the system include directories, so that #include <foo.h>
+ * lines can be followed without searching those directories on every run
  * 
- * @param barrier A promise that will be set when the thread finishes
- * @return void
+ * The index is built once by walking the system directories, and saved to a
+ * file that later runs map with mmap(); looking a name up is then a single
+ * probe of an open addressing hash table, and nothing in the system
+ * directories is read except the mtimes of the directories, when the index
+ * is loaded, and the size and mtime of each header a crawl reaches, when it
+ * first asks for its includes (see edgesOf()). It holds
+ * 
+ * - nodes: one per header file, with its path, size, mtime, content hash, the
+ *   include lines it contains, and the nodes those lines resolve to
+ * - slots: a hash table from each name that reaches a node by #include <name>
+ *   (relative to the first system directory that has it) to the node
+ * - dirs: every directory walked, with its mtime
+ * 
+ * The index is rebuilt when the system directories differ or any of their
+ * directories has changed (as when a package adds, removes or replaces a
+ * header). A header edited in place leaves its directory's mtime alone, so
+ * it is only noticed when reached: its includes are then read from the file
+ * instead, and refresh() rebuilds the index at the end of the run. A rebuild
+ * only rereads the headers whose size or mtime changed, and only rescans
+ * those whose content hash changed too.
+ * System headers are scanned without evaluating conditionals, so every
+ * #include and #include_next they contain counts, while includes spelled
+ * with a macro are not followed.
 */
-void do_work(std::promise<void> barrier) 
+struct SysIndex
 {
-  std::string filename;
+  struct Header {
+    char magic[16];
+    uint64_t config;   // hash of the system directories
+    uint32_t ndirs, nnodes, nslots, nincs, nedges, npool;
+    uint64_t dirsOff, nodesOff, slotsOff, incsOff, edgesOff, poolOff;
+  };
+  struct Dir {
+    int64_t mtime;
+    uint32_t path;     // offset in the string pool
+    uint32_t pad;
+  };
+  struct Node {
+    int64_t size;
+    int64_t mtime;
+    uint64_t hash;
+    uint32_t path;
+    uint32_t root;     // the system directory it was found in
+    uint32_t firstInc, nincs;   // include lines, as '<', '"' or '!' (#include_next) + name
+    uint32_t firstEdge, nedges; // the nodes they resolve to
+  };
+  struct Slot {
+    uint64_t hash;
+    uint32_t name;     // 0 (the empty string) for an empty slot
+    uint32_t node;
+  };
+  static constexpr char MAGIC[16] = "ddsysindex 1\n";
+  enum Check : uint8_t { UNCHECKED, CURRENT, EDITED };
 
-  // 4. for each file on the workQ
-  while ( (filename = workQ.get_next()) != "" ) {
-    //printf("(%d) WorkQ size: %zu\n", std::this_thread::get_id(), workQ.size());
-    //std::string filename = workQ.pop_front();
-    //printf("(%d) Processing %s\n", std::this_thread::get_id(), filename.c_str());
+  // the nodes an include line leads to
+  struct Edges {
+    const uint32_t *first;
+    uint32_t n;
+    const uint32_t *begin() const { return first; }
+    const uint32_t *end() const { return first + n; }
+  };
 
-    if (theTable.find(filename) == theTable.end()) {
-      fprintf(stderr, "Mismatch between table and workQ\n");
-      break;
-    }
+  bool enabled = false;
+  std::vector<std::string> roots; // the system directories, each ending in '/'
+  const char *base = nullptr;
+  size_t length = 0;
+  const Header *hdr = nullptr;
+  const Dir *dirTab = nullptr;
+  const Node *nodes = nullptr;
+  const Slot *slots = nullptr;
+  const uint32_t *incs = nullptr;
+  const uint32_t *edges = nullptr;
+  const char *pool = nullptr;
+  std::unique_ptr<std::atomic<uint8_t>[]> checked; // node -> Check
+  std::atomic<bool> edited{false}; // some header reached was EDITED
+  std::mutex m; // protects rescanned and byPath
+  std::unordered_map<uint32_t, std::vector<uint32_t>> rescanned; // EDITED node -> edges
+  std::unordered_map<std::string_view, uint32_t> byPath; // built for the first EDITED node
 
-    // 4a&b. lookup dependencies and invoke 'process'
-    process(filename.c_str(), theTable.get(filename));
+  ~SysIndex() {
+    detach();
   }
-  //printf("Work done, signal now\n");
-  barrier.set_value();
-  
-}
 
-int main(int argc, char *argv[]) {
-  // 1. look up CPATH in environment
-  char *cpath = getenv("CPATH");
+  uint64_t configHash() const {
+    std::string all;
+    for (auto &r : roots)
+      all += r + "\n";
+    return hashBytes(all.data(), all.size());
+  }
 
-  // determine the number of -Idir arguments
-  int i;
-  for (i = 1; i < argc; i++) {
-    if (strncmp(argv[i], "-I", 2) != 0)
-      break;
+  /**
+   * @brief Returns the node reached by #include <name>
+   * 
+   * @param name The name between the angle brackets
+   * @return long The node, or -1 if no system directory has the name
+  */
+  long find(std::string_view name) const {
+    if (hdr == nullptr)
+      return -1;
+    uint64_t h = hashBytes(name.data(), name.size());
+    uint32_t mask = hdr->nslots - 1;
+    for (uint32_t i = h & mask; slots[i].name != 0; i = (i + 1) & mask) {
+      if (slots[i].hash == h && name == pool + slots[i].name)
+        return slots[i].node;
+    }
+    return -1;
   }
-  int start = i;
 
-  // 2. start assembling dirs vector
-  dirs.push_back( dirName("./") ); // always search current directory first
-  for (i = 1; i < start; i++) {
-    dirs.push_back( dirName(argv[i] + 2 /* skip -I */) );
+  const char *path(uint32_t node) const {
+    return pool + nodes[node].path;
   }
-  if (cpath != NULL) {
-    std::string str( cpath );
-    std::string::size_type last = 0;
-    std::string::size_type next = 0;
-    while((next = str.find(":", last)) != std::string::npos) {
-      dirs.push_back( str.substr(last, next-last) );
-      last = next + 1;
+
+  /**
+   * @brief Returns the nodes a header's include lines lead to, checking the
+   * first time it is asked that the header has not been edited since the
+   * index was built
+   * 
+   * An edited header's lines are read again and resolved against the index,
+   * which still holds every header there is, as no directory changed.
+   * 
+   * @param node The header
+   * @return Edges The nodes
+  */
+  Edges edgesOf(uint32_t node) {
+    uint8_t c = checked[node].load(std::memory_order_acquire);
+    if (c == UNCHECKED)
+      c = check(node);
+    if (c == CURRENT)
+      return { edges + nodes[node].firstEdge, nodes[node].nedges };
+    std::unique_lock<std::mutex> lock(m);
+    const std::vector<uint32_t> &out = rescanned[node];
+    return { out.data(), (uint32_t)out.size() };
+  }
+
+  // edgesOf() for a header not checked yet
+  uint8_t check(uint32_t node) {
+    const Node &n = nodes[node];
+    struct stat st;
+    if (stat(path(node), &st) == 0 && st.st_size == n.size && mtimeNs(st) == n.mtime) {
+      checked[node].store(CURRENT, std::memory_order_release);
+      return CURRENT;
+    }
+    // 1. read it, unless it is gone or only touched
+    std::vector<std::string> lines;
+    int fd = open(path(node), O_RDONLY);
+    MappedFile mf;
+    bool mapped = fd >= 0 && fstat(fd, &st) == 0 && mf.map(fd, st.st_size);
+    if (fd >= 0)
+      close(fd);
+    if (mapped && hashBytes(mf.data, mf.size) == n.hash) {
+      checked[node].store(CURRENT, std::memory_order_release);
+      return CURRENT;
+    }
+    if (mapped)
+      scan(mf.data, mf.size, &lines);
+    // 2. resolve its lines, as build() does
+    std::unique_lock<std::mutex> lock(m);
+    if (byPath.empty())
+      for (uint32_t i = 0; i < hdr->nnodes; i++)
+        byPath.emplace(path(i), i);
+    auto atPath = [this](const std::string &p) -> long {
+      auto it = byPath.find(p);
+      return it == byPath.end() ? -1 : (long)it->second;
+    };
+    auto atName = [this](const std::string &name) { return find(name); };
+    std::vector<uint32_t> out;
+    for (auto &line : lines) {
+      long to = resolveLine(line, path(node), n.root, atPath, atName);
+      if (to >= 0 && to != (long)node && std::find(out.begin(), out.end(), (uint32_t)to) == out.end())
+        out.push_back(to);
     }
-    dirs.push_back( str.substr(last) );
+    rescanned.emplace(node, std::move(out)); // another thread may have been first
+    edited = true;
+    checked[node].store(EDITED, std::memory_order_release);
+    return EDITED;
   }
-  // 2. finished assembling dirs vector
 
-  // 3. for each file argument ...
-  for (i = start; i < argc; i++) {
-    std::pair<std::string, std::string> pair = parseFile(argv[i]);
-    if (pair.second != "c" && pair.second != "y" && pair.second != "l") {
-      fprintf(stderr, "Illegal extension: %s - must be .c, .y or .l\n",
-              pair.second.c_str());
-      return -1;
+  /**
+   * @brief Finds the header an include line of another header leads to:
+   * "x.h" next to it first, then as <x.h>; #include_next <x.h> in the system
+   * directories after its own
+   * 
+   * @param line The line, as scan() returns it
+   * @param from The path of the header it is in
+   * @param root The system directory that header is in
+   * @param atPath Returns the node at a path, or -1
+   * @param atName Returns the node #include <name> reaches, or -1
+   * @return long The node, or -1
+  */
+  template <typename AtPath, typename AtName>
+  long resolveLine(const std::string &line, const std::string &from, uint32_t root,
+                   AtPath atPath, AtName atName) const {
+    std::string name = line.substr(1);
+    long to = -1;
+    if (line[0] == '!') {
+      for (size_t r = root + 1; to < 0 && r < roots.size(); r++)
+        to = atPath(roots[r] + name);
+      return to;
     }
+    if (line[0] == '"')
+      to = atPath(from.substr(0, from.rfind('/') + 1) + name);
+    return to < 0 ? atName(name) : to;
+  }
 
-    std::string obj = pair.first + ".o";
+  /**
+   * @brief Maps an index file, checking that it is well formed
+   * 
+   * @param file The index file
+   * @return bool True if it was mapped
+  */
+  bool attach(const char *file) {
+    detach();
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header);
+    void *p = ok ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED)
+      return false;
+    base = (const char *)p;
+    length = st.st_size;
+    hdr = (const Header *)base;
+    auto fits = [this](uint64_t off, uint64_t n, size_t size) {
+      return off % 8 == 0 && off <= length && n <= (length - off) / size;
+    };
+    ok = memcmp(hdr->magic, MAGIC, sizeof(MAGIC)) == 0 &&
+         fits(hdr->dirsOff, hdr->ndirs, sizeof(Dir)) &&
+         fits(hdr->nodesOff, hdr->nnodes, sizeof(Node)) &&
+         fits(hdr->slotsOff, hdr->nslots, sizeof(Slot)) &&
+         fits(hdr->incsOff, hdr->nincs, sizeof(uint32_t)) &&
+         fits(hdr->edgesOff, hdr->nedges, sizeof(uint32_t)) &&
+         fits(hdr->poolOff, hdr->npool, 1) && hdr->npool > 0 &&
+         hdr->nslots > 0 && (hdr->nslots & (hdr->nslots - 1)) == 0 &&
+         base[hdr->poolOff + hdr->npool - 1] == '\0';
+    if (ok) {
+      dirTab = (const Dir *)(base + hdr->dirsOff);
+      nodes = (const Node *)(base + hdr->nodesOff);
+      slots = (const Slot *)(base + hdr->slotsOff);
+      incs = (const uint32_t *)(base + hdr->incsOff);
+      edges = (const uint32_t *)(base + hdr->edgesOff);
+      pool = base + hdr->poolOff;
+      // every offset and id must be in range, so lookups need no checks
+      for (uint32_t i = 0; ok && i < hdr->ndirs; i++)
+        ok = dirTab[i].path < hdr->npool;
+      for (uint32_t i = 0; ok && i < hdr->nslots; i++)
+        ok = slots[i].name < hdr->npool && (slots[i].name == 0 || slots[i].node < hdr->nnodes);
+      for (uint32_t i = 0; ok && i < hdr->nnodes; i++) {
+        const Node &n = nodes[i];
+        ok = n.path < hdr->npool && n.firstInc <= hdr->nincs && n.nincs <= hdr->nincs - n.firstInc &&
+             n.firstEdge <= hdr->nedges && n.nedges <= hdr->nedges - n.firstEdge;
+      }
+      for (uint32_t i = 0; ok && i < hdr->nincs; i++)
+        ok = incs[i] < hdr->npool;
+      for (uint32_t i = 0; ok && i < hdr->nedges; i++)
+        ok = edges[i] < hdr->nnodes;
+      if (ok)
+        checked.reset(new std::atomic<uint8_t>[hdr->nnodes]());
+    }
+    if (!ok)
+      detach();
+    return ok;
+  }
 
-    // 3a. insert mapping from file.o to file.ext
-    theTable.insert( { obj, { argv[i] } } );
-    
-    // 3b. insert mapping from file.ext to empty list
-    theTable.insert( { argv[i], { } } );
-    
-    // 3c. append file.ext on workQ
-    workQ.push_back( argv[i] );
+  void detach() {
+    if (base)
+      munmap((void *)base, length);
+    base = nullptr;
+    hdr = nullptr;
+    checked.reset();
+    rescanned.clear();
+    byPath.clear();
+    edited = false;
   }
 
-  // 3.5. Get the number of threads to use
-  char *numThreadsEnv = getenv("CRAWLER_THREADS");
-  int numThreads = CRAWLER_THREADS_DEFAULT;
-  if (numThreadsEnv) {
-    try {
-      numThreads = std::stoi(numThreadsEnv);
-      if (numThreads < 0)
-        numThreads = CRAWLER_THREADS_DEFAULT;
-    } catch (...) {
-        numThreads = CRAWLER_THREADS_DEFAULT;
+  /**
+   * @brief Checks that the mapped index was made from the current system
+   * directories, and that none of their directories has changed since; the
+   * headers are checked as they are reached (see edgesOf())
+   * 
+   * @return bool True if the index can be used
+  */
+  bool fresh() const {
+    if (hdr == nullptr || hdr->config != configHash())
+      return false;
+    struct stat st;
+    for (uint32_t i = 0; i < hdr->ndirs; i++) {
+      if (stat(pool + dirTab[i].path, &st) != 0 || mtimeNs(st) != dirTab[i].mtime)
+        return false;
     }
+    return true;
   }
-  //printf("Using %d threads\n", numThreads);
 
-  // 3.6. Create the threads
-  if (numThreads > 0)
-  {
-    std::vector<std::promise<void>> wpromises(numThreads);
-    std::vector<std::future<void>> wfutures(numThreads);
-    std::vector<std::thread> workers(numThreads);
-    for (i = 0; i < numThreads; i++) {
-      //printf("Creating thread %d\n", i);
-      wfutures[i] = wpromises[i].get_future();
-      workers[i] = std::thread(do_work, std::move(wpromises[i]));
+  /**
+   * @brief Finds the include lines of a system header
+   * 
+   * Unlike scanIncludes(), blanks are allowed after the '#', angle brackets
+   * and #include_next are recognised, and each name is returned with its kind
+   * ('"', '<' or '!' for #include_next <...>) in front.
+   * 
+   * @param buf The start of the file
+   * @param size The length of the file
+   * @param found Filled with the include lines
+   * @return void
+  */
+  static void scan(const char *buf, size_t size, std::vector<std::string> *found) {
+    const char *end = buf + size;
+    const char *p = buf;
+    while (p < end && (p = (const char *)memchr(p, '#', end - p)) != NULL) {
+      const char *b = p;
+      while (b > buf && isBlank(b[-1])) { b--; }
+      if (b > buf && b[-1] != '\n') { p++; continue; }
+      const char *eol = (const char *)memchr(p, '\n', end - p);
+      if (eol == NULL) { eol = end; }
+      const char *q = p + 1;
+      while (q < eol && isBlank(*q)) { q++; }
+      if (eol - q >= 7 && memcmp(q, "include", 7) == 0) {
+        q += 7;
+        bool next = eol - q >= 5 && memcmp(q, "_next", 5) == 0;
+        if (next) { q += 5; }
+        while (q < eol && isBlank(*q)) { q++; }
+        if (q < eol && (*q == '"' || *q == '<')) {
+          char close = *q == '"' ? '"' : '>';
+          const char *e = (const char *)memchr(q + 1, close, eol - q - 1);
+          if (e != NULL && e > q + 1)
+            found->push_back((next ? '!' : *q) + std::string(q + 1, e));
+        }
+      }
+      p = eol;
+    }
+  }
+
+  /**
+   * @brief Builds the index and writes it to a file, reusing what it can from
+   * the mapped (possibly stale) index
+   * 
+   * @param file The index file, replaced atomically
+   * @return bool True on success
+  */
+  bool build(const char *file) {
+    std::vector<std::string> paths;       // node -> path
+    std::vector<uint32_t> rootOf;          // node -> system directory
+    std::vector<struct stat> stats;        // node -> stat
+    std::unordered_map<std::string, uint32_t> nodeOf;  // path -> node
+    std::vector<std::pair<std::string, uint32_t>> names; // #include <name> -> node
+    std::unordered_set<std::string> named;
+    std::vector<std::pair<std::string, int64_t>> walked; // directory, mtime
+    std::unordered_set<std::string> walkedSet;
+
+    // 1. walk each system directory, depth first, noting every header
+    for (uint32_t r = 0; r < roots.size(); r++) {
+      std::set<std::pair<dev_t, ino_t>> visited; // against symlink loops
+      std::vector<std::string> stack = { "" };
+      while (!stack.empty()) {
+        std::string rel = stack.back();
+        stack.pop_back();
+        std::string dir = roots[r] + rel;
+        DIR *d = opendir(dir.c_str());
+        if (d == NULL)
+          continue;
+        struct stat st;
+        if (fstat(dirfd(d), &st) != 0 || !visited.insert({ st.st_dev, st.st_ino }).second) {
+          closedir(d);
+          continue;
+        }
+        if (walkedSet.insert(dir).second)
+          walked.push_back({ dir, mtimeNs(st) });
+        std::vector<std::string> entries;
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+          if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0)
+            entries.push_back(e->d_name);
+        }
+        closedir(d);
+        std::sort(entries.begin(), entries.end()); // the same tree gives the same index
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+          std::string path = dir + *it;
+          if (stat(path.c_str(), &st) != 0)
+            continue;
+          if (S_ISDIR(st.st_mode)) {
+            stack.push_back(rel + *it + "/");
+          } else if (S_ISREG(st.st_mode)) {
+            auto ins = nodeOf.insert({ path, (uint32_t)paths.size() });
+            if (ins.second) {
+              paths.push_back(path);
+              rootOf.push_back(r);
+              stats.push_back(st);
+            }
+            if (named.insert(rel + *it).second)
+              names.push_back({ rel + *it, ins.first->second });
+          }
+        }
+      }
+    }
+
+    // 2. find each header's include lines, from the old index when its size
+    //    and mtime, or else its content hash, are unchanged
+    std::unordered_map<std::string, uint32_t> old;
+    if (hdr) {
+      for (uint32_t i = 0; i < hdr->nnodes; i++)
+        old[pool + nodes[i].path] = i;
+    }
+    std::vector<uint64_t> hashes(paths.size());
+    std::vector<std::vector<std::string>> lines(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+      auto o = old.find(paths[i]);
+      if (o != old.end() && nodes[o->second].size == stats[i].st_size &&
+          nodes[o->second].mtime == mtimeNs(stats[i])) {
+        const Node &n = nodes[o->second];
+        hashes[i] = n.hash;
+        for (uint32_t k = 0; k < n.nincs; k++)
+          lines[i].push_back(pool + incs[n.firstInc + k]);
+        continue;
+      }
+      int fd = open(paths[i].c_str(), O_RDONLY);
+      if (fd < 0)
+        continue;
+      MappedFile mf;
+      bool mapped = mf.map(fd, stats[i].st_size);
+      close(fd);
+      if (mapped) {
+        hashes[i] = hashBytes(mf.data, mf.size);
+        if (o != old.end() && nodes[o->second].hash == hashes[i]) {
+          const Node &n = nodes[o->second]; // touched, but not changed
+          for (uint32_t k = 0; k < n.nincs; k++)
+            lines[i].push_back(pool + incs[n.firstInc + k]);
+        } else {
+          scan(mf.data, mf.size, &lines[i]);
+        }
+      }
     }
 
-    // 3.7. Wait for the threads to finish
-    for (i = 0; i < numThreads; i++) {
-      //printf("Waiting for thread %d\n", i);
-      wfutures[i].wait();
-      workers[i].join();
+    // 3. resolve the include lines: "x.h" next to the header first, then as
+    //    <x.h>; #include_next <x.h> in the system directories after the
+    //    header's own
+    std::unordered_map<std::string, uint32_t> byName(names.begin(), names.end());
+    auto atPath = [&nodeOf](const std::string &p) -> long {
+      auto it = nodeOf.find(p);
+      return it == nodeOf.end() ? -1 : (long)it->second;
+    };
+    auto atName = [&byName](const std::string &name) -> long {
+      auto it = byName.find(name);
+      return it == byName.end() ? -1 : (long)it->second;
+    };
+    std::vector<std::vector<uint32_t>> out(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+      for (auto &line : lines[i]) {
+        long to = resolveLine(line, paths[i], rootOf[i], atPath, atName);
+        if (to >= 0 && to != (long)i &&
+            std::find(out[i].begin(), out[i].end(), (uint32_t)to) == out[i].end())
+          out[i].push_back(to);
+      }
     }
+
+    // 4. lay the index out and write it
+    std::string strings(1, '\0');
+    auto intern = [&strings](const std::string &s) {
+      uint32_t off = strings.size();
+      strings.append(s.c_str(), s.size() + 1);
+      return off;
+    };
+    std::vector<Dir> newDirs;
+    for (auto &w : walked)
+      newDirs.push_back({ w.second, intern(w.first), 0 });
+    std::vector<Node> newNodes;
+    std::vector<uint32_t> newIncs;
+    std::vector<uint32_t> newEdges;
+    for (size_t i = 0; i < paths.size(); i++) {
+      Node n = { stats[i].st_size, mtimeNs(stats[i]), hashes[i], intern(paths[i]), rootOf[i],
+                 (uint32_t)newIncs.size(), (uint32_t)lines[i].size(),
+                 (uint32_t)newEdges.size(), (uint32_t)out[i].size() };
+      for (auto &line : lines[i])
+        newIncs.push_back(intern(line));
+      newEdges.insert(newEdges.end(), out[i].begin(), out[i].end());
+      newNodes.push_back(n);
+    }
+    uint32_t nslots = 16;
+    while (nslots < 2 * names.size())
+      nslots *= 2;
+    std::vector<Slot> newSlots(nslots, Slot{ 0, 0, 0 });
+    for (auto &nm : names) {
+      uint64_t h = hashBytes(nm.first.data(), nm.first.size());
+      uint32_t i = h & (nslots - 1);
+      while (newSlots[i].name != 0)
+        i = (i + 1) & (nslots - 1);
+      newSlots[i] = { h, intern(nm.first), nm.second };
+    }
+    if (strings.size() > UINT32_MAX) {
+      fprintf(stderr, "System index too large\n");
+      return false;
+    }
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.config = configHash();
+    h.ndirs = newDirs.size();
+    h.nnodes = newNodes.size();
+    h.nslots = nslots;
+    h.nincs = newIncs.size();
+    h.nedges = newEdges.size();
+    h.npool = strings.size();
+    uint64_t off = sizeof(Header);
+    auto place = [&off](size_t bytes) {
+      uint64_t at = off;
+      off = (off + bytes + 7) & ~(uint64_t)7;
+      return at;
+    };
+    h.dirsOff = place(newDirs.size() * sizeof(Dir));
+    h.nodesOff = place(newNodes.size() * sizeof(Node));
+    h.slotsOff = place(newSlots.size() * sizeof(Slot));
+    h.incsOff = place(newIncs.size() * sizeof(uint32_t));
+    h.edgesOff = place(newEdges.size() * sizeof(uint32_t));
+    h.poolOff = place(strings.size());
+    std::string image(off, '\0');
+    memcpy(&image[0], &h, sizeof(h));
+    memcpy(&image[h.dirsOff], newDirs.data(), newDirs.size() * sizeof(Dir));
+    memcpy(&image[h.nodesOff], newNodes.data(), newNodes.size() * sizeof(Node));
+    memcpy(&image[h.slotsOff], newSlots.data(), newSlots.size() * sizeof(Slot));
+    memcpy(&image[h.incsOff], newIncs.data(), newIncs.size() * sizeof(uint32_t));
+    memcpy(&image[h.edgesOff], newEdges.data(), newEdges.size() * sizeof(uint32_t));
+    memcpy(&image[h.poolOff], strings.data(), strings.size());
+
+    std::string tmp = std::string(file) + ".tmp." + std::to_string(getpid());
+    FILE *fd = fopen(tmp.c_str(), "wb");
+    if (fd == NULL) {
+      fprintf(stderr, "Error writing %s\n", tmp.c_str());
+      return false;
+    }
+    bool ok = fwrite(image.data(), 1, image.size(), fd) == image.size();
+    ok = fclose(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), file) != 0) {
+      fprintf(stderr, "Error writing %s\n", file);
+      unlink(tmp.c_str());
+      return false;
+    }
+    return true;
   }
-  else // Do sequential processing
-  {
-    do_work((std::promise<void>()));
+
+  /**
+   * @brief Maps the index file, first rebuilding it if it is missing or stale
+   * 
+   * @param file The index file
+   * @return bool True if the index is ready
+  */
+  bool load(const char *file) {
+    if (attach(file) && fresh())
+      return enabled = true;
+    bool built = build(file);
+    detach();
+    return enabled = built && attach(file);
   }
-  
-  // 4. for each file on the workQ => in do_work
-  /*while ( workQ.size() > 0 ) {
-    std::string filename = workQ.front();
-    workQ.pop_front();
 
-    if (theTable.find(filename) == theTable.end()) {
-      fprintf(stderr, "Mismatch between table and workQ\n");
-      return -1;
+  /**
+   * @brief Rebuilds the index file if a header reached was found edited, so
+   * that later runs need not read it again
+   * 
+   * @param file The index file
+   * @return void
+  */
+  void refresh(const char *file) {
+    if (enabled && edited)
+      build(file);
+  }
+
+  /**
+   * @brief Asks the compiler for its system directories, as "cc -v" lists
+   * them (with the multiarch one, such as /usr/include/x86_64-linux-gnu)
+   * 
+   * @return std::string The directories, separated by ':', or the usual two
+   * if the compiler could not be run; $CC is used instead of cc if set
+  */
+  static std::string compilerDirs() {
+    const char *cc = getenv("CC");
+    std::string cmd = std::string(cc && *cc ? cc : "cc") + " -E -v -x c /dev/null 2>&1 >/dev/null";
+    std::string dirs;
+    FILE *fd = popen(cmd.c_str(), "r");
+    if (fd != NULL) {
+      char line[4096];
+      bool in = false;
+      while (fgets(line, sizeof(line), fd) != NULL) {
+        if (strncmp(line, "#include <...>", 14) == 0) {
+          in = true;
+        } else if (strncmp(line, "End of search list", 18) == 0) {
+          in = false;
+        } else if (in && line[0] == ' ') {
+          std::string dir(line + 1, strcspn(line + 1, "\n"));
+          if (dir.find(" (framework directory)") == std::string::npos)
+            dirs += (dirs.empty() ? "" : ":") + dir;
+        }
+      }
+      pclose(fd);
     }
+    return dirs.empty() ? "/usr/local/include:/usr/include" : dirs;
+  }
+};
 
-    // 4a&b. lookup dependencies and invoke 'process'
-    process(filename.c_str(), &theTable[filename]);
-  }*/
+SysIndex sysIndex;
 
-  // 5. for each file argument
-  for (i = start; i < argc; i++) {
-    // 5a. create hash table in which to track file names already printed
-    std::unordered_set<std::string> printed;
-    // 5b. create list to track dependencies yet to print
-    std::list<std::string> toProcess;
+// macros for conditional scanning: name -> replacement text, or NOT_DEFINED
+// for a macro known not to be defined (by -U or #undef); a name that is not
+// there at all may be defined by some header, so its value is unknown
+typedef std::unordered_map<std::string, std::string> Macros;
+static const std::string NOT_DEFINED(1, '\0');
+
+/**
+ * @brief How files are scanned, as the command line says; each
+ * DependencyGraph (and CompDb) holds its own
+*/
+struct ScanOptions
+{
+  bool conditional = false; // --conditional, -D or -U given
+  bool grammars = false;    // --grammar
+  Macros macros;            // from -D and -U
+
+  /**
+   * @brief Takes one command line argument, if it is a scanning option
+   * 
+   * @param arg The argument
+   * @return bool Whether it was --conditional, --grammar, -D or -U
+  */
+  bool parse(const char *arg) {
+    if (strcmp(arg, "--conditional") == 0) {
+      conditional = true;
+    } else if (strcmp(arg, "--grammar") == 0) {
+      grammars = true;
+    } else if (strncmp(arg, "-D", 2) == 0) {
+      conditional = true;
+      std::string def = arg + 2;
+      std::string::size_type eq = def.find('=');
+      if (eq == std::string::npos)
+        macros[def] = "1";
+      else
+        macros[def.substr(0, eq)] = def.substr(eq + 1);
+    } else if (strncmp(arg, "-U", 2) == 0) {
+      conditional = true;
+      macros[arg + 2] = NOT_DEFINED;
+    } else {
+      return false;
+    }
+    return true;
+  }
+};
+
+static inline bool isIdent(char c) {
+  return isalnum((unsigned char)c) || c == '_';
+}
 
-    std::pair<std::string, std::string> pair = parseFile(argv[i]);
+/**
+ * @brief Evaluates an #if expression with C precedence and integer arithmetic
+ * 
+ * Identifiers that are defined object-like macros are replaced by the value of
+ * their replacement text, others are 0. A function-like use, other than
+ * defined and __has_include, is 0 and its arguments are skipped. __has_include
+ * looks on the search path given, if any.
+ * 
+ * The value is only a guess, and unknown is set, when it depends on a macro
+ * that is neither defined nor known not to be (see Macros), on a
+ * function-like use, or on anything else that cannot be evaluated.
+*/
+struct CondExpr
+{
+  const Macros &macros;
+  const char *p;
+  const char *end;
+  const std::vector<std::string> *dirs;
+  int depth;
+  bool unknown = false;
 
-    std::string obj = pair.first + ".o";
-    // 5c. print "foo.o:" ...
-    printf("%s:", obj.c_str());
-    // 5c. ... insert "foo.o" into hash table and append to list
-    printed.insert( obj );
-    toProcess.push_back( obj );
-    // 5d. invoke
-    printDependencies(&printed, &toProcess, stdout);
+  CondExpr(const Macros &m, const std::string &text,
+           const std::vector<std::string> *search = NULL, int d = 0)
+    : macros(m), p(text.data()), end(text.data() + text.size()), dirs(search), depth(d) {}
 
-    printf("\n");
+  void skipBlanks() {
+    while (p < end && isspace((unsigned char)*p)) { p++; }
+  }
+
+  bool accept(const char *op) {
+    skipBlanks();
+    size_t n = strlen(op);
+    if ((size_t)(end - p) < n || memcmp(p, op, n) != 0)
+      return false;
+    // don't take "<" out of "<<" or "<=", "&" out of "&&", and so on
+    if (n == 1 && p + 1 < end && strchr("<>&|=", *op) && (p[1] == *op || p[1] == '='))
+      return false;
+    p += n;
+    return true;
+  }
+
+  std::string ident() {
+    skipBlanks();
+    const char *q = p;
+    while (p < end && isIdent(*p)) { p++; }
+    return std::string(q, p);
+  }
+
+  // skip a parenthesised argument list, if there is one
+  void skipArgs() {
+    skipBlanks();
+    if (p >= end || *p != '(')
+      return;
+    int nest = 0;
+    for (; p < end; p++) {
+      if (*p == '(') nest++;
+      else if (*p == ')' && --nest == 0) { p++; return; }
+    }
+  }
+
+  long long primary() {
+    skipBlanks();
+    if (p >= end)
+      return 0;
+    if (accept("("))  {
+      long long v = ternary();
+      accept(")");
+      return v;
+    }
+    if (isdigit((unsigned char)*p)) {
+      char *q;
+      long long v = strtoull(p, &q, 0);
+      p = q;
+      while (p < end && isIdent(*p)) { p++; } // u, l suffixes
+      return v;
+    }
+    if (*p == '\'') {
+      // character constant, with only simple escapes
+      p++;
+      long long v = 0;
+      if (p < end && *p == '\\') {
+        p++;
+        if (p < end) {
+          switch (*p) {
+            case 'n': v = '\n'; break;
+            case 't': v = '\t'; break;
+            case '0': v = 0; break;
+            default: v = (unsigned char)*p;
+          }
+          p++;
+        }
+      } else if (p < end) {
+        v = (unsigned char)*p++;
+      }
+      while (p < end && *p != '\'') { p++; }
+      if (p < end) { p++; }
+      return v;
+    }
+    if (isIdent(*p)) {
+      std::string name = ident();
+      if (name == "defined") {
+        bool paren = accept("(");
+        std::string m = ident();
+        if (paren)
+          accept(")");
+        auto it = macros.find(m);
+        if (it == macros.end())
+          unknown = true;
+        return it != macros.end() && it->second != NOT_DEFINED ? 1 : 0;
+      }
+      if (name == "__has_include") {
+        skipBlanks();
+        const char *q = p;
+        skipArgs();
+        std::string arg(q, p);
+        std::string::size_type a = arg.find('"');
+        std::string::size_type b = arg.rfind('"');
+        if (a == std::string::npos || b <= a) {
+          // <...> files are only known through the system index
+          a = arg.find('<');
+          b = arg.rfind('>');
+          if (!sysIndex.enabled || a == std::string::npos || b == std::string::npos || b <= a) {
+            unknown = true;
+            return 0;
+          }
+          return sysIndex.find(arg.substr(a + 1, b - a - 1)) >= 0 ? 1 : 0;
+        }
+        std::string file = arg.substr(a + 1, b - a - 1);
+        for (size_t i = 0; dirs && i < dirs->size(); i++) {
+          if (dirCache.contains((*dirs)[i], file))
+            return 1;
+        }
+        return 0;
+      }
+      auto it = macros.find(name);
+      skipBlanks();
+      if (p < end && *p == '(') {
+        skipArgs();
+        unknown = true;
+        return 0;
+      }
+      if (it == macros.end() || depth > 16) {
+        unknown = true;
+        return 0;
+      }
+      if (it->second == NOT_DEFINED)
+        return 0;
+      CondExpr inner(macros, it->second, dirs, depth + 1);
+      long long v = inner.ternary();
+      unknown |= inner.unknown;
+      return v;
+    }
+    p++; // something we cannot evaluate
+    unknown = true;
+    return 0;
+  }
+
+  long long unary() {
+    if (accept("!")) return !unary();
+    if (accept("~")) return ~unary();
+    if (accept("-")) return -unary();
+    if (accept("+")) return unary();
+    return primary();
+  }
+
+  // binary operators, from loosest to tightest
+  long long binary(int level) {
+    static const char *ops[][4] = {
+      { "||" }, { "&&" }, { "|" }, { "^" }, { "&" },
+      { "==", "!=" }, { "<=", ">=", "<", ">" }, { "<<", ">>" },
+      { "+", "-" }, { "*", "/", "%" },
+    };
+    const int levels = sizeof(ops) / sizeof(ops[0]);
+    if (level == levels)
+      return unary();
+    long long v = binary(level + 1);
+    for (;;) {
+      const char *op = NULL;
+      for (int i = 0; i < 4 && ops[level][i]; i++) {
+        if (accept(ops[level][i])) { op = ops[level][i]; break; }
+      }
+      if (op == NULL)
+        return v;
+      bool was = unknown;
+      long long r = binary(level + 1);
+      // the right of a decided && or || is not evaluated, so cannot make it unknown
+      if ((!strcmp(op, "&&") && !v) || (!strcmp(op, "||") && v))
+        unknown = was;
+      if (!strcmp(op, "||")) v = v || r;
+      else if (!strcmp(op, "&&")) v = v && r;
+      else if (!strcmp(op, "|")) v = v | r;
+      else if (!strcmp(op, "^")) v = v ^ r;
+      else if (!strcmp(op, "&")) v = v & r;
+      else if (!strcmp(op, "==")) v = v == r;
+      else if (!strcmp(op, "!=")) v = v != r;
+      else if (!strcmp(op, "<=")) v = v <= r;
+      else if (!strcmp(op, ">=")) v = v >= r;
+      else if (!strcmp(op, "<")) v = v < r;
+      else if (!strcmp(op, ">")) v = v > r;
+      else if (!strcmp(op, "<<")) v = (r >= 0 && r < 64) ? (long long)((unsigned long long)v << r) : 0;
+      else if (!strcmp(op, ">>")) v = (r >= 0 && r < 64) ? v >> r : 0;
+      else if (!strcmp(op, "+")) v = (long long)((unsigned long long)v + r);
+      else if (!strcmp(op, "-")) v = (long long)((unsigned long long)v - r);
+      else if (!strcmp(op, "*")) v = (long long)((unsigned long long)v * r);
+      else if (!strcmp(op, "/")) v = (r == 0 || (r == -1 && v == LLONG_MIN)) ? 0 : v / r;
+      else if (!strcmp(op, "%")) v = (r == 0 || r == -1) ? 0 : v % r;
+    }
+  }
+
+  long long ternary() {
+    long long c = binary(0);
+    if (!accept("?"))
+      return c;
+    // only the branch taken can make it unknown
+    bool was = unknown;
+    long long a = ternary();
+    bool unknownA = unknown;
+    unknown = was;
+    accept(":");
+    long long b = ternary();
+    unknown = was || (c ? unknownA : unknown);
+    return c ? a : b;
+  }
+};
+
+/**
+ * @brief Calls handle(directive, text, eol) for each preprocessor line in a buffer
+ * 
+ * Lines are found as in scanIncludes(). The directive is the name after the
+ * '#' (blanks allowed in between), text is the rest of the line with
+ * backslash-newline continuations joined and comments removed, and eol is
+ * where the line (including any continuations and comment) ends.
+ * 
+ * @param buf The start of the buffer
+ * @param size The length of the buffer
+ * @param handle Called for each directive, in source order
+ * @return void
+*/
+template <typename Handler>
+static void forEachDirective(const char *buf, size_t size, Handler handle) {
+  const char *end = buf + size;
+  const char *p = buf;
+  std::string text;
+  while (p < end && (p = (const char *)memchr(p, '#', end - p)) != NULL) {
+    const char *b = p;
+    while (b > buf && isBlank(b[-1])) { b--; }
+    if (b > buf && b[-1] != '\n') { p++; continue; }
+    const char *q = p + 1;
+    while (q < end && isBlank(*q)) { q++; }
+    const char *name = q;
+    while (q < end && isIdent(*q)) { q++; }
+    std::string directive(name, q);
+    // join continuation lines
+    text.clear();
+    const char *eol;
+    for (;;) {
+      eol = (const char *)memchr(q, '\n', end - q);
+      if (eol == NULL) { eol = end; }
+      const char *stop = eol;
+      if (stop > q && stop[-1] == '\r') { stop--; }
+      if (stop > q && stop[-1] == '\\' && eol < end) {
+        text.append(q, stop - 1);
+        q = eol + 1;
+        continue;
+      }
+      text.append(q, stop);
+      break;
+    }
+    // remove comments; one left open carries on past the end of the line
+    std::string::size_type c = 0;
+    while ((c = text.find('/', c)) != std::string::npos && c + 1 < text.size()) {
+      if (text[c + 1] == '/') {
+        text.erase(c);
+        break;
+      }
+      if (text[c + 1] != '*') {
+        c++;
+        continue;
+      }
+      std::string::size_type close = text.find("*/", c + 2);
+      if (close == std::string::npos) {
+        text.erase(c);
+        const char *after = (const char *)memmem(eol, end - eol, "*/", 2);
+        eol = after ? after + 2 : end;
+        break;
+      }
+      text.replace(c, close + 2 - c, " ");
+    }
+    handle(directive, text, eol);
+    p = eol;
+  }
+}
+
+// skip whitespace and comments, returning where anything else starts
+static const char *skipSpaceAndComments(const char *p, const char *end) {
+  while (p < end) {
+    if (isspace((unsigned char)*p)) {
+      p++;
+    } else if (*p == '/' && p + 1 < end && p[1] == '/') {
+      p = (const char *)memchr(p, '\n', end - p);
+      if (p == NULL) { p = end; }
+    } else if (*p == '/' && p + 1 < end && p[1] == '*') {
+      const char *close = (const char *)memmem(p + 2, end - p - 2, "*/", 2);
+      p = close ? close + 2 : end;
+    } else {
+      break;
+    }
+  }
+  return p;
+}
+
+/**
+ * @brief Finds a header's include guard
+ * 
+ * A file is guarded by X if, apart from whitespace and comments, it is wholly
+ * inside "#ifndef X" (or "#if !defined(X)") and "#define X" ... "#endif", with
+ * no #else or #elif for that #ifndef. A file with a "#pragma once" outside any
+ * conditional is guarded too.
+ * 
+ * @param buf The start of the file
+ * @param size The length of the file
+ * @return std::string The guard macro, "#pragma once", or "" if not guarded
+*/
+static std::string detectGuard(const char *buf, size_t size) {
+  const char *end = buf + size;
+  const char *first = skipSpaceAndComments(buf, end);
+  if (first == end || *first != '#')
+    return "";
+  std::string guard;
+  const char *closed = NULL; // end of the #endif that closes the guard
+  bool once = false;
+  bool ok = true;
+  int n = 0;
+  int depth = 0;
+  Macros none;
+  forEachDirective(buf, size, [&](const std::string &directive, const std::string &text,
+                                  const char *eol) {
+    CondExpr e(none, text);
+    if (n == 0) {
+      if (directive == "ifndef") {
+        guard = e.ident();
+      } else if (directive == "if" && e.accept("!") && e.ident() == "defined") {
+        bool paren = e.accept("(");
+        guard = e.ident();
+        if (paren && !e.accept(")"))
+          guard.clear();
+        e.skipBlanks();
+        if (e.p != e.end)
+          guard.clear(); // more than !defined(X)
+      }
+    } else if (n == 1 && !guard.empty()) {
+      if (directive != "define" || e.ident() != guard)
+        guard.clear();
+    }
+    n++;
+    if (closed)
+      ok = false; // something after the guard's #endif
+    if (directive == "pragma" && depth <= (guard.empty() ? 0 : 1) && e.ident() == "once")
+      once = true;
+    if (directive == "if" || directive == "ifdef" || directive == "ifndef") {
+      depth++;
+    } else if ((directive == "else" || directive == "elif") && depth == 1) {
+      ok = false;
+    } else if (directive == "endif" && depth > 0 && --depth == 0) {
+      closed = eol;
+    }
+  });
+  if (once)
+    return "#pragma once";
+  if (guard.empty() || !ok || closed == NULL || skipSpaceAndComments(closed, end) != end)
+    return "";
+  return guard;
+}
+
+/**
+ * @brief What including a header can change, for a conditional scan
+ * 
+ * For one file on its own (see readFacts()), touched holds every macro it
+ * #defines or #undefs, in any group, includes holds what it includes as
+ * written ("<x.h>" for an angle include, "!x.h" for #include_next), and opaque
+ * is set if it includes something spelled with a macro. For a header with all
+ * it reaches (see closeFacts()), touched and opaque cover every file reached,
+ * and opaque is also set if one cannot be found or read: such a file may
+ * change any macro.
+*/
+struct HeaderFacts
+{
+  std::string guard; // as from detectGuard()
+  std::vector<std::string> includes;
+  std::unordered_set<std::string> touched;
+  bool opaque = false;
+};
+typedef std::shared_ptr<const HeaderFacts> Facts;
+
+// the facts of a file that cannot be read, which may change any macro
+static Facts unknownFacts() {
+  static const Facts unknown = []() {
+    auto f = std::make_shared<HeaderFacts>();
+    f->opaque = true;
+    return Facts(f);
+  }();
+  return unknown;
+}
+
+/**
+ * @brief Finds the facts of one file on its own
+ * 
+ * @param buf The start of the file
+ * @param size The length of the file
+ * @return Facts Its guard, the macros it sets and what it includes
+*/
+static Facts readFacts(const char *buf, size_t size) {
+  auto f = std::make_shared<HeaderFacts>();
+  f->guard = detectGuard(buf, size);
+  Macros none;
+  forEachDirective(buf, size, [&f, &none](const std::string &directive, const std::string &text,
+                                          const char *) {
+    if (directive == "define" || directive == "undef") {
+      CondExpr e(none, text);
+      std::string name = e.ident();
+      if (!name.empty())
+        f->touched.insert(name);
+    } else if (directive == "include" || directive == "include_next") {
+      std::string::size_type a = text.find_first_not_of(" \t\v\f\r");
+      char close = a == std::string::npos ? 0 : text[a] == '"' ? '"' : text[a] == '<' ? '>' : 0;
+      std::string::size_type b = close ? text.find(close, a + 1) : std::string::npos;
+      if (b == std::string::npos || b == a + 1) {
+        f->opaque = true;
+        return;
+      }
+      std::string name = text.substr(a + 1, b - a - 1);
+      if (directive == "include_next")
+        f->includes.push_back("!" + name);
+      else
+        f->includes.push_back(close == '>' ? "<" + name + ">" : name);
+    }
+  });
+  return Facts(f);
+}
+
+// the facts of the file at path on its own, or NULL if it cannot be read
+static Facts readFacts(const std::string &path) {
+  Facts f;
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0) {
+    MappedFile mf;
+    if (mf.map(fd, st.st_size))
+      f = readFacts(mf.data, mf.size);
+  }
+  if (fd >= 0)
+    close(fd);
+  return f;
+}
+
+/**
+ * @brief Works out the facts of a header with every file it reaches
+ * 
+ * Files are named by keys, which the callers choose; a system header's key is
+ * "<" followed by its node in sysIndex, and its includes are the node's edges.
+ * 
+ * @param key The header's key
+ * @param ownOf Returns the facts of a file on its own, by key, or NULL if it
+ * cannot be read
+ * @param keyOf Returns the key of a name a (non-system) file includes, as in
+ * HeaderFacts::includes, or "" if it cannot be found
+ * @param closedOf Returns the facts of a file with all it reaches, by key, if
+ * they are known already, or NULL
+ * @return Facts The header's guard, and what it and every file it reaches
+ * may change
+*/
+template <typename OwnFn, typename KeyFn, typename ClosedFn>
+static Facts closeFacts(const std::string &key, OwnFn ownOf, KeyFn keyOf, ClosedFn closedOf) {
+  auto f = std::make_shared<HeaderFacts>();
+  std::unordered_set<std::string> seen = { key };
+  std::vector<std::string> stack = { key };
+  while (!stack.empty() && !f->opaque) {
+    std::string k = stack.back();
+    stack.pop_back();
+    Facts g = k == key || k.empty() ? Facts() : closedOf(k);
+    if (g) {
+      // already worked out, with everything below it
+      f->touched.insert(g->touched.begin(), g->touched.end());
+      f->opaque = g->opaque;
+      continue;
+    }
+    g = k.empty() ? Facts() : ownOf(k);
+    if (!g) {
+      f->opaque = true;
+      continue;
+    }
+    if (k == key)
+      f->guard = g->guard;
+    f->touched.insert(g->touched.begin(), g->touched.end());
+    f->opaque = g->opaque;
+    std::vector<std::string> next;
+    if (k[0] == '<') {
+      for (uint32_t e : sysIndex.edgesOf(atol(k.c_str() + 1)))
+        next.push_back("<" + std::to_string(e));
+    } else {
+      for (auto &name : g->includes)
+        next.push_back(keyOf(name));
+    }
+    for (auto &n : next) {
+      if (seen.insert(n).second)
+        stack.push_back(n);
+    }
+  }
+  // an opaque header leaves every macro unknown, whatever else it sets
+  if (f->opaque)
+    f->touched.clear();
+  return Facts(f);
+}
+
+/**
+ * @brief The facts of every header a crawl's conditional scans include, each
+ * worked out once, so that a scan can tell what including one changes
+*/
+struct FactTable
+{
+  const std::vector<std::string> &dirs; // where names are looked for
+  std::unordered_map<std::string, Facts> own;    // key -> facts on its own
+  std::unordered_map<std::string, Facts> closed; // key -> with all it reaches
+  std::mutex m;
+
+  explicit FactTable(const std::vector<std::string> &d) : dirs(d) {}
+
+  // the key of an included name: the name itself, or for a system header "<"
+  // and its node; "" if it is not known
+  static std::string keyOf(const std::string &name) {
+    if (name[0] == '!')
+      return ""; // #include_next is not followed outside the system index
+    if (name[0] != '<')
+      return name;
+    long node = sysIndex.enabled ? sysIndex.find(name.substr(1, name.size() - 2)) : -1;
+    return node < 0 ? "" : "<" + std::to_string(node);
+  }
+
+  Facts ownOf(const std::string &key) {
+    {
+      std::unique_lock<std::mutex> lock(m);
+      auto it = own.find(key);
+      if (it != own.end())
+        return it->second;
+    }
+    Facts f;
+    if (key[0] == '<') {
+      f = readFacts(std::string(sysIndex.path(atol(key.c_str() + 1))));
+    } else {
+      std::string path;
+      int fd = openFile(dirs, key.c_str(), &path);
+      if (fd >= 0) {
+        close(fd);
+        f = readFacts(path);
+      }
+    }
+    std::unique_lock<std::mutex> lock(m);
+    return own.emplace(key, f).first->second;
+  }
+
+  /**
+   * @brief Returns what including a file changes, working it out the first
+   * time it is asked for
+   * 
+   * @param name The file, as included ("<x.h>" for an angle include)
+   * @return Facts Its facts with all it reaches, as from closeFacts()
+  */
+  Facts get(const std::string &name) {
+    std::string key = keyOf(name);
+    if (key.empty())
+      return unknownFacts();
+    {
+      std::unique_lock<std::mutex> lock(m);
+      auto it = closed.find(key);
+      if (it != closed.end())
+        return it->second;
+    }
+    Facts f = closeFacts(key, [this](const std::string &k) { return ownOf(k); }, keyOf,
+                         [this](const std::string &k) {
+                           std::unique_lock<std::mutex> lock(m);
+                           auto it = closed.find(k);
+                           return it == closed.end() ? Facts() : it->second;
+                         });
+    std::unique_lock<std::mutex> lock(m);
+    return closed.emplace(key, f).first->second;
+  }
+
+  void clear() {
+    std::unique_lock<std::mutex> lock(m);
+    own.clear();
+    closed.clear();
+  }
+};
+
+/**
+ * @brief Finds the #include "foo.h" lines of a buffer that may be in taken groups
+ * 
+ * After a header is included its guard counts as defined, so a later
+ * "#ifndef X_H / #include "x.h" / #endif" does not re-enter it.
+ * 
+ * A scan does not see what its includer defines, so a condition on a macro
+ * that is not known (see Macros) may go either way: every branch it could
+ * select is kept, and so is each later #else. A macro #defined or #undef'd
+ * where it is not certain the group is taken becomes unknown, and so does
+ * every macro that an included header, or a header it reaches, #defines or
+ * #undefs anywhere. A header that cannot be read or found leaves every macro
+ * unknown; as without the system index (CRAWLER_SYSINDEX) so does any
+ * #include <x.h>, -D and -U then only decide the conditions before the first
+ * one. The scan can so report more includes than a compiler would follow,
+ * but never fewer.
+ * 
+ * @param buf The start of the buffer
+ * @param size The length of the buffer
+ * @param found Called with each included file name, in source order
+ * @param dirs The search path, for __has_include
+ * @param initial The macros defined before the first line (cmdMacros)
+ * @param self The buffer's own include guard, as from detectGuard(), which is
+ * taken as not defined yet
+ * @param factsOf Returns the facts of an included file name, with all it
+ * reaches ("<x.h>" for an angle include), as from closeFacts() (FactTable::get)
+ * @return void
+*/
+template <typename Callback, typename FactsFn>
+static void scanConditional(const char *buf, size_t size, Callback found,
+                            const std::vector<std::string> &dirs,
+                            const Macros &initial, const std::string &self,
+                            FactsFn factsOf) {
+  struct Group {
+    bool outer;     // the enclosing group may be taken
+    bool outerSure; // the enclosing group is taken
+    bool taken;     // an earlier branch of this #if is taken
+    bool maybe;     // an earlier branch of this #if may be taken
+    bool active;    // the current branch may be taken
+    bool sure;      // the current branch is taken
+  };
+  std::vector<Group> groups;
+  Macros macros = initial;
+  if (!self.empty() && self != "#pragma once" && !macros.count(self))
+    macros[self] = NOT_DEFINED;
+  std::unordered_set<std::string> once; // included headers with #pragma once
+  auto active = [&groups]() { return groups.empty() || groups.back().active; };
+  auto sure = [&groups]() { return groups.empty() || groups.back().sure; };
+  // evaluate a condition: false, true, or (with *unknown set) either
+  auto test = [&](const std::string &directive, const std::string &text, bool *unknown) {
+    CondExpr e(macros, text, &dirs);
+    bool v;
+    if (directive == "if" || directive == "elif") {
+      v = e.ternary() != 0;
+    } else {
+      auto it = macros.find(e.ident());
+      e.unknown = it == macros.end();
+      v = !e.unknown && it->second != NOT_DEFINED;
+      if (directive == "ifndef")
+        v = !v;
+    }
+    *unknown = e.unknown;
+    return v;
+  };
+  // a macro set where it is not certain the group is taken is unknown after
+  auto set = [&](const std::string &name, const std::string &value) {
+    if (sure())
+      macros[name] = value;
+    else
+      macros.erase(name);
+  };
+
+  forEachDirective(buf, size, [&](const std::string &directive, const std::string &text,
+                                  const char *) {
+    if (directive == "if" || directive == "ifdef" || directive == "ifndef") {
+      Group g = { active(), sure(), false, false, false, false };
+      if (g.outer) {
+        bool unknown;
+        bool v = test(directive, text, &unknown);
+        g.taken = v && !unknown;
+        g.maybe = v || unknown;
+        g.active = g.maybe;
+        g.sure = g.outerSure && g.taken;
+      }
+      groups.push_back(g);
+    } else if (directive == "elif") {
+      if (groups.empty())
+        return;
+      Group &g = groups.back();
+      g.active = g.sure = false;
+      if (g.outer && !g.taken) {
+        bool unknown;
+        bool v = test(directive, text, &unknown);
+        g.active = v || unknown;
+        g.sure = g.outerSure && !g.maybe && v && !unknown;
+        g.taken |= v && !unknown;
+        g.maybe |= g.active;
+      }
+    } else if (directive == "else") {
+      if (groups.empty())
+        return;
+      Group &g = groups.back();
+      g.active = g.outer && !g.taken;
+      g.sure = g.outerSure && !g.maybe;
+      g.taken = g.maybe = true;
+    } else if (directive == "endif") {
+      if (!groups.empty())
+        groups.pop_back();
+    } else if (!active()) {
+      return;
+    } else if (directive == "define") {
+      CondExpr e(macros, text);
+      std::string name = e.ident();
+      if (name.empty())
+        return;
+      if (e.p < e.end && *e.p == '(') {
+        set(name, ""); // function-like: defined, but never expanded
+        return;
+      }
+      set(name, std::string(e.p, e.end));
+    } else if (directive == "undef") {
+      CondExpr e(macros, text);
+      std::string name = e.ident();
+      if (!name.empty())
+        set(name, NOT_DEFINED);
+    } else if (directive == "include" || directive == "include_next") {
+      std::string::size_type a = text.find_first_not_of(" \t\v\f\r");
+      std::string name; // as factsOf() takes it, "" if it cannot be named
+      if (directive == "include" && a != std::string::npos && text[a] == '<') {
+        std::string::size_type b = text.find('>', a + 1);
+        if (b != std::string::npos) {
+          name = text.substr(a, b - a + 1);
+          if (sysIndex.enabled)
+            found(name);
+        }
+      } else if (directive == "include" && a != std::string::npos && text[a] == '"') {
+        std::string::size_type b = text.find('"', a + 1);
+        name = text.substr(a + 1, b == std::string::npos ? std::string::npos : b - a - 1);
+        if (once.count(name))
+          return; // already included, and it is never entered again
+        found(name);
+      }
+      Facts facts = name.empty() ? unknownFacts() : factsOf(name);
+      // what the header may change is unknown after it
+      for (auto it = macros.begin(); it != macros.end(); ) {
+        if (facts->opaque || facts->touched.count(it->first))
+          it = macros.erase(it);
+        else
+          ++it;
+      }
+      // including a guarded header defines its guard for the rest of this file
+      const std::string &guard = facts->guard;
+      if (guard == "#pragma once") {
+        if (sure())
+          once.insert(name);
+      } else if (!guard.empty() && !macros.count(guard)) {
+        set(guard, "");
+      }
+    }
+  });
+}
+
+/**
+ * @brief Opens queued headers ahead of the workers, with CRAWLER_PREFETCH threads
+ * 
+ * Each name pushed is opened and its whole content requested with
+ * posix_fadvise(POSIX_FADV_WILLNEED), which starts the read in the background,
+ * so on a cold page cache or a network file system reading one file overlaps
+ * scanning others. The open descriptor is then kept for process() to take, up
+ * to MAX_OPEN of them; past that it is closed once the read has been started.
+*/
+struct Prefetcher
+{
+  static const size_t MAX_OPEN = 256;
+  struct Opened {
+    int fd;           // -1 once process() has asked for the file
+    std::string path;
+  };
+  std::list<std::string> queue;
+  std::unordered_map<std::string, Opened> opened;
+  size_t held = 0;    // descriptors in opened
+  std::mutex m;
+  std::condition_variable cv;
+  std::unique_ptr<ThreadPool> threads;
+  bool stopping = false;
+  int numThreads = 0;
+  const std::vector<std::string> &dirs; // where names are looked for
+
+  explicit Prefetcher(const std::vector<std::string> &d) : dirs(d) {}
+
+  /**
+   * @brief Starts the prefetch threads
+   * 
+   * @return void
+  */
+  void start() {
+    stopping = false;
+    ThreadPool::Options o;
+    o.threads = numThreads;
+    threads.reset(new ThreadPool(o));
+    for (int i = 0; i < numThreads; i++)
+      threads->submit([this]() { run(); });
+  }
+
+  /**
+   * @brief Stops the prefetch threads and closes whatever was not taken
+   * 
+   * @return void
+  */
+  void stop() {
+    {
+      std::unique_lock<std::mutex> lock(m);
+      stopping = true;
+    }
+    cv.notify_all();
+    threads.reset(); // waits for each run() to return
+    for (auto &p : opened)
+      if (p.second.fd >= 0)
+        close(p.second.fd);
+    opened.clear();
+    queue.clear();
+    held = 0;
+  }
+
+  /**
+   * @brief Queues a file name to be opened ahead of process()
+   * 
+   * @param name The file name, as included
+   * @return void
+  */
+  void push(std::string_view name) {
+    if (!threads)
+      return;
+    {
+      std::unique_lock<std::mutex> lock(m);
+      queue.emplace_back(name);
+    }
+    cv.notify_one();
+  }
+
+  /**
+   * @brief Takes the descriptor a prefetch thread opened for a file
+   * 
+   * @param name The file name, as included
+   * @param path Set to the path the file was opened through
+   * @return int The descriptor, or -1 if the file has not been opened yet (it
+   * will then not be opened by a prefetch thread either)
+  */
+  int take(const std::string &name, std::string *path) {
+    if (!threads)
+      return -1;
+    std::unique_lock<std::mutex> lock(m);
+    auto ins = opened.insert({ name, { -1, "" } });
+    Opened &o = ins.first->second;
+    if (ins.second || o.fd < 0)
+      return -1;
+    int fd = o.fd;
+    *path = o.path;
+    o.fd = -1;
+    held--;
+    return fd;
+  }
+
+  // the body of each prefetch thread
+  void run() {
+    for (;;) {
+      std::string name;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+        if (stopping)
+          return;
+        name = queue.front();
+        queue.pop_front();
+        if (opened.count(name))
+          continue; // process() got there first
+      }
+      std::string path;
+      int fd = openFile(dirs, name.c_str(), &path);
+      if (fd < 0)
+        continue; // process() reports it
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      {
+        std::unique_lock<std::mutex> lock(m);
+        if (held < MAX_OPEN && opened.insert({ name, { fd, path } }).second) {
+          held++;
+          fd = -1;
+        }
+      }
+      if (fd >= 0)
+        close(fd);
+    }
+  }
+};
+
+/**
+ * @brief Identifies files by (device, inode), so that the different spellings
+ * of a file ("x.h" and "../inc/x.h", say) are one node
+ * 
+ * Each spelling maps to the identity of the file it was last opened as, and
+ * each identity to the includes last read from that file (with the size and
+ * mtime they were read at), so a file reached under a second spelling is not
+ * scanned again. An identity is written "\1dev:ino", which is never a file name.
+ * The includes are kept in arena, so storing them takes nothing from the
+ * global heap once its pools are warm.
+*/
+struct FileIds
+{
+  struct Read {
+    int64_t size = 0;
+    int64_t mtime = 0;
+    std::pmr::vector<std::pmr::string> includes;
+    std::string guard;
+
+    explicit Read(std::pmr::memory_resource *mr) : includes(mr) {}
+  };
+  std::pmr::unsynchronized_pool_resource arena; // used under m
+  std::unordered_map<std::string, std::string> bySpelling;
+  std::unordered_map<std::string, Read> reads;
+  std::mutex m;
+
+  static std::string idOf(const struct stat &st) {
+    return "\1" + std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino);
+  }
+
+  // record that a spelling names the file with the given identity
+  void bind(const std::string &spelling, const std::string &id) {
+    std::unique_lock<std::mutex> lock(m);
+    bySpelling[spelling] = id;
+  }
+
+  /**
+   * @brief Returns what a spelling is known as
+   * 
+   * @param spelling An include name or path
+   * @return std::string Its file's identity, or the spelling itself if it has
+   * not been opened
+  */
+  std::string keyOf(const std::string &spelling) {
+    std::unique_lock<std::mutex> lock(m);
+    auto it = bySpelling.find(spelling);
+    return it == bySpelling.end() ? spelling : it->second;
+  }
+
+  /**
+   * @brief Returns the identity of the file at a path, with stat() the first
+   * time it is asked for
+   * 
+   * @param path The path
+   * @return std::string The identity, or the path if it does not exist
+  */
+  std::string keyOfPath(const std::string &path) {
+    {
+      std::unique_lock<std::mutex> lock(m);
+      auto it = bySpelling.find(path);
+      if (it != bySpelling.end())
+        return it->second;
+    }
+    struct stat st;
+    std::string id = stat(path.c_str(), &st) == 0 ? idOf(st) : path;
+    bind(path, id);
+    return id;
+  }
+
+  /**
+   * @brief Takes the includes already read from a file under another spelling
+   * 
+   * @param id The file's identity
+   * @param st The file's stat, to check it has not changed since
+   * @param includes Filled with the includes on a hit
+   * @param guard Set to the include guard on a hit
+   * @return bool True on a hit
+  */
+  template <typename Includes>
+  bool lookup(const std::string &id, const struct stat &st,
+              Includes *includes, std::string *guard) {
+    std::unique_lock<std::mutex> lock(m);
+    auto it = reads.find(id);
+    if (it == reads.end() || it->second.size != st.st_size || it->second.mtime != mtimeNs(st))
+      return false;
+    includes->assign(it->second.includes.begin(), it->second.includes.end());
+    *guard = it->second.guard;
+    return true;
+  }
+
+  // remember the includes read from a file
+  template <typename Includes>
+  void store(const std::string &id, const struct stat &st,
+             const Includes &includes, const std::string &guard) {
+    std::unique_lock<std::mutex> lock(m);
+    Read &r = reads.try_emplace(id, &arena).first->second;
+    r.size = st.st_size;
+    r.mtime = mtimeNs(st);
+    r.includes.assign(includes.begin(), includes.end());
+    r.guard = guard;
+  }
+};
+
+static bool isGrammar(const char *file) {
+  std::string ext = parseFile(file).second;
+  return ext == "y" || ext == "l";
+}
+
+/**
+ * @brief Keeps only the C code of a yacc or lex file: its %{ ... %} blocks
+ * and everything after the second %%, which are copied into the generated C
+ * 
+ * Other lines are blanked, so line numbers are unchanged.
+ * 
+ * @param buf The file
+ * @param size Its size
+ * @return std::string The C code
+*/
+static std::string grammarCode(const char *buf, size_t size) {
+  std::string code;
+  code.reserve(size);
+  bool inBlock = false;
+  int sections = 0; // %% lines seen
+  const char *end = buf + size;
+  for (const char *p = buf; p < end; ) {
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    if (eol == NULL)
+      eol = end;
+    size_t len = eol - p;
+    bool marker = false;
+    if (len >= 2 && p[0] == '%') {
+      marker = true;
+      if (!inBlock && p[1] == '{')
+        inBlock = true;
+      else if (inBlock && p[1] == '}')
+        inBlock = false;
+      else if (!inBlock && p[1] == '%')
+        sections++;
+      else
+        marker = false;
+    }
+    if (!marker && (inBlock || sections >= 2))
+      code.append(p, len);
+    code += '\n';
+    p = eol + 1;
+  }
+  return code;
+}
+
+/**
+ * @brief A worker's scratch memory for the includes of the file it is
+ * reading, given back in one go when the file is done
+ * 
+ * Each thread has one arena, which starts with a buffer of SIZE bytes, enough
+ * for the includes of most files, so reading a file takes nothing from the
+ * global heap; a bigger file takes the rest from it until the scope ends.
+ * Scopes may nest, and the arena is released when the outermost one ends.
+*/
+struct ScanScope
+{
+  struct Arena {
+    static const size_t SIZE = 64 * 1024;
+    std::unique_ptr<char[]> buf{new char[SIZE]};
+    std::pmr::monotonic_buffer_resource res{buf.get(), SIZE};
+    int scopes = 0;
+  };
+  Arena &arena;
+
+  static Arena &mine() {
+    static thread_local Arena arena;
+    return arena;
+  }
+
+  ScanScope() : arena(mine()) {
+    arena.scopes++;
+  }
+
+  ~ScanScope() {
+    if (--arena.scopes == 0)
+      arena.res.release();
+  }
+
+  std::pmr::memory_resource *resource() {
+    return &arena.res;
+  }
+};
+
+/**
+ * @brief Finds the include lines of an open file, from the cache or by
+ * scanning it (steps 1a to 3 of process())
+ * 
+ * @param fd The open file, which is closed
+ * @param path The path it was opened through
+ * @param file The name to report errors with
+ * @param dirs The search path, for __has_include when conditional
+ * @param opts Whether to scan conditionally, and grammars
+ * @param macros The macros defined before the first line, when conditional
+ * @param useCache Whether to look the file up in depCache and update it
+ * @param factsOf As for scanConditional()
+ * @param includes Filled with the included file names: a vector of strings,
+ * std or pmr (as from a ScanScope)
+ * @param guard Set to the file's include guard, when conditional or caching
+ * @return bool False if the file could not be read
+*/
+template <typename FactsFn, typename Includes>
+static bool readIncludes(int fd, const std::string &path, const char *file,
+                         const std::vector<std::string> &dirs, const ScanOptions &opts,
+                         const Macros &macros, bool useCache, FactsFn factsOf,
+                         Includes *includes, std::string *guard) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    fprintf(stderr, "Error reading %s\n", file);
+    close(fd);
+    return false;
+  }
+  // 1a. unchanged since it was cached?
+  if (useCache && depCache.lookup(path, st, includes, guard)) {
+    close(fd);
+    return true;
+  }
+  // 1b. map the file
+  uint64_t t1 = myStats ? nowNs() : 0;
+  MappedFile mf;
+  bool mapped = mf.map(fd, st.st_size);
+  close(fd);
+  if (!mapped) {
+    fprintf(stderr, "Error reading %s\n", file);
+    return false;
+  }
+  uint64_t hash = 0;
+  if (useCache) {
+    hash = hashBytes(mf.data, mf.size);
+    if (depCache.lookup(path, st, hash, includes, guard))
+      mapped = false; // content unchanged, no need to scan
+  }
+  if (mapped) {
+    // 2. for each #include "foo.h" line of the file
+    auto add = [includes](const std::string &name) {
+      includes->emplace_back(name);
+    };
+    // with --grammar, only the C code of a grammar is scanned
+    std::string code;
+    const char *text = mf.data;
+    size_t textSize = mf.size;
+    if (opts.grammars && isGrammar(file)) {
+      code = grammarCode(mf.data, mf.size);
+      text = code.data();
+      textSize = code.size();
+    }
+    // 2d. note the file's include guard
+    if (opts.conditional || useCache)
+      *guard = detectGuard(mf.data, mf.size);
+    if (opts.conditional)
+      scanConditional(text, textSize, add, dirs, macros, *guard, factsOf);
+    else
+      scanIncludes(text, textSize, add, sysIndex.enabled);
+    if (useCache)
+      depCache.update(path, st, hash, *includes, *guard);
+    if (myStats)
+      myStats->bytes += mf.size;
+  }
+  if (myStats)
+    myStats->scanNs += nowNs() - t1;
+  // 3. unmap the file (when mf goes out of scope)
+  return true;
+}
+
+/**
+ * @brief The state of one crawl: the search path, the table, the work queue
+ * and what has been learned about the files read
+ * 
+ * Nothing a crawl writes is global, so a process can hold several graphs
+ * (with different search paths, say) and crawl them one after another or at
+ * once. A graph kept after its crawl is brought up to date with update(),
+ * which rescans only the files that changed; IdGraph::update() then redoes
+ * only the rows of the frozen graph whose includes changed. What is shared
+ * by every graph is what is true of the file system: dirCache, depCache and
+ * sysIndex; how files are scanned is each graph's own opts.
+*/
+struct DependencyGraph
+{
+  std::vector<std::string> dirs;
+  ScanOptions opts;
+  ConcMap theTable;
+  ConcQueue workQ;
+  FactTable factTable{dirs}; // with --conditional
+  FileIds fileIds;
+  Prefetcher prefetcher{dirs};
+  ConcMap origins; // with trackOrigins: opened path -> table keys read from it
+  bool trackOrigins = false; // needed by update(), from the first crawl on
+  std::unordered_set<std::string> targets; // the foo.o keys of the file arguments
+  // each file yacc or lex makes from a grammar argument -> the arguments it
+  // depends on: for C files, those it is made from, since their code is copied
+  // in; none for headers, which hold only the token numbers (make's rule for
+  // the header, not the header's includers, depends on the grammar)
+  std::unordered_map<std::string, std::vector<std::string>> generated;
+
+  const std::vector<std::string> *generatedBy(const char *file);
+  void addSystemHeader(uint32_t node);
+  template <typename Enqueue>
+  void processOpened(const char *file, int fd, const std::string &path,
+                     DepList *ll, Enqueue enqueue);
+  void process(const char *file, DepList *ll);
+  void do_work();
+  bool addTarget(const char *file);
+  void crawl(ThreadPool &pool);
+  std::vector<std::string> update(const std::vector<std::string> &changed, ThreadPool &pool);
+  void reset();
+};
+
+// the grammar arguments that make file, or NULL if it is not made by one
+const std::vector<std::string> *DependencyGraph::generatedBy(const char *file) {
+  if (!opts.grammars)
+    return NULL;
+  auto it = generated.find(file);
+  return it == generated.end() ? NULL : &it->second;
+}
+
+/**
+ * @brief Adds a system header and everything it includes to the table
+ * 
+ * Each header's dependencies come straight from the system index, so none of
+ * them is opened or queued.
+ * 
+ * @param node The header's node in sysIndex
+ * @return void
+*/
+void DependencyGraph::addSystemHeader(uint32_t node) {
+  std::vector<uint32_t> stack = { node };
+  while (!stack.empty()) {
+    uint32_t n = stack.back();
+    stack.pop_back();
+    SysIndex::Edges edges = sysIndex.edgesOf(n);
+    DepList deps(theTable.resource());
+    for (uint32_t e : edges)
+      deps.emplace_back(sysIndex.path(e));
+    if (!theTable.insert({ sysIndex.path(n), std::move(deps) }).second)
+      continue; // already there, with everything below it
+    stack.insert(stack.end(), edges.begin(), edges.end());
+  }
+}
+
+/**
+ * @brief Steps 1a-2 of process(), for a file that has been opened
+ * 
+ * @param file The file name, as included
+ * @param fd The open file (closed here), or -1 if it could not be opened
+ * @param path The path it was opened as
+ * @param ll The file's list of dependencies, appended to
+ * @param enqueue Called with each newly found file name, to have it processed;
+ * the name is the table's key, so it stays put as long as the table does
+ * @return void
+*/
+template <typename Enqueue>
+void DependencyGraph::processOpened(const char *file, int fd, const std::string &path,
+                                    DepList *ll, Enqueue enqueue) {
+  if (myStats)
+    myStats->files++;
+  // with --grammar, a file yacc or lex makes depends on its grammars
+  const std::vector<std::string> *grammarsOf = generatedBy(file);
+  if (fd < 0 && grammarsOf) {
+    // not made yet, so that is all it depends on
+    DepList deps(grammarsOf->begin(), grammarsOf->end(), theTable.resource());
+    ll->swap(deps);
+    return;
+  }
+  if (fd < 0) {
+    fprintf(stderr, "Error opening %s\n", file);
+    //exit(-1);
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    fprintf(stderr, "Error reading %s\n", file);
+    close(fd);
+    return;
+  }
+  ScanScope scan;
+  std::pmr::vector<std::pmr::string> includes(scan.resource());
+  std::string guard;
+  // 1a. the same file may have been read under another spelling
+  std::string id = FileIds::idOf(st);
+  fileIds.bind(file, id);
+  if (fileIds.lookup(id, st, &includes, &guard)) {
+    close(fd);
+  } else {
+    if (!readIncludes(fd, path, file, dirs, opts, opts.macros, depCache.enabled,
+                      [this](const std::string &name) { return factTable.get(name); },
+                      &includes, &guard))
+      return;
+    fileIds.store(id, st, includes, guard);
+  }
+  if (trackOrigins)
+    origins.appendUnique(path, file);
+  // 1c. record each included file, in source order
+  DepList deps(theTable.resource());
+  for (auto &name : includes) {
+    if (name[0] == '<') {
+      // a system header, known by its path
+      long node = sysIndex.find(std::string_view(name).substr(1, name.size() - 2));
+      if (node < 0)
+        continue; // not in any system directory
+      deps.emplace_back(sysIndex.path(node));
+      addSystemHeader(node);
+      continue;
+    }
+    // 2bii. append file name to dependency list
+    deps.emplace_back( name );
+    // 2bii. if file name not already in table, insert mapping from file name
+    // to empty list in table (in one step, so only one thread can find it new) ...
+    auto ins = theTable.insert( { std::string(name), {} } );
+    if (!ins.second) { continue; }
+    // ... and have it processed
+    enqueue( std::string_view(ins.first->first) );
+  }
+  if (grammarsOf)
+    deps.insert(deps.end(), grammarsOf->begin(), grammarsOf->end());
+  // the file's list is written once, by the one thread that processed it
+  ll->swap(deps);
+}
+
+// process file, looking for #include "foo.h" lines
+void DependencyGraph::process(const char *file, DepList *ll) {
+  // 1. open the file
+  std::string path;
+  uint64_t t0 = myStats ? nowNs() : 0;
+  int fd = prefetcher.take(file, &path);
+  if (fd >= 0 && myStats)
+    myStats->prefetched++;
+  if (fd < 0)
+    fd = openFile(dirs, file, &path);
+  if (myStats)
+    myStats->openNs += nowNs() - t0;
+  processOpened(file, fd, path, ll, [this](std::string_view name) {
+    // 2bii. ... append file name to workQ (and start reading it)
+    prefetcher.push( name );
+    workQ.push_stable( name );
+  });
+}
+
+/**
+ * @brief The function that each thread will execute. 
+ * It will make step 4 of the main function.
+ * 
+ * @return void
+*/
+void DependencyGraph::do_work()
+{
+  std::string filename;
+  if (crawlStats.enabled)
+    crawlStats.registerThread();
+
+  // 4. for each file on the workQ
+  while ( (filename = workQ.get_next()) != "" ) {
+
+    if (theTable.find(filename) == theTable.end()) {
+      fprintf(stderr, "Mismatch between table and workQ\n");
+    } else {
+      // 4a&b. lookup dependencies and invoke 'process'
+      process(filename.c_str(), theTable.get(filename));
+    }
+    workQ.done();
+  }
+  if (myStats) {
+    myStats->endNs = nowNs();
+    myStats = nullptr;
+  }
+}
+
+// 3. for one file argument: returns false if it has an illegal extension
+bool DependencyGraph::addTarget(const char *file) {
+  std::pair<std::string, std::string> pair = parseFile(file);
+  if (pair.second != "c" && pair.second != "y" && pair.second != "l") {
+    fprintf(stderr, "Illegal extension: %s - must be .c, .y or .l\n",
+            pair.second.c_str());
+    return false;
+  }
+
+  std::string obj = pair.first + ".o";
+
+  // 3a. insert mapping from file.o to file.ext
+  theTable.insert( { obj, { file } } );
+  targets.insert(obj);
+
+  // 3b. insert mapping from file.ext to empty list
+  // 3c. append file.ext on workQ (unless an earlier query already did)
+  auto ins = theTable.insert( { file, { } } );
+  if (ins.second)
+    workQ.push_stable( ins.first->first );
+
+  // 3d. with --grammar, note the files yacc or lex will make from it
+  if (opts.grammars && pair.second != "c") {
+    std::vector<std::string> outputs = { "lex.yy.c" };
+    if (pair.second == "y") {
+      outputs = { "y.tab.c", pair.first + ".tab.c" };
+      generated["y.tab.h"];
+      generated[pair.first + ".tab.h"];
+    }
+    for (auto &out : outputs) {
+      auto &by = generated[out];
+      if (std::find(by.begin(), by.end(), file) == by.end())
+        by.push_back(file);
+    }
+  }
+  return true;
+}
+
+#ifdef CRAWLER_COROUTINES
+/**
+ * @brief The coroutine crawl, used with CRAWLER_ENGINE=coro
+ * 
+ * Each file is a FileTask, a coroutine that co_awaits a Read, then scans the
+ * file on the executor and starts a FileTask for each new header it finds.
+ * A Read opens the file on the io pool (CRAWLER_CORO_IO threads, default 64)
+ * and starts reading it into the page cache with
+ * posix_fadvise(POSIX_FADV_WILLNEED), which does not wait for the read, then
+ * resumes the FileTask. So up to MAX_OPEN reads are in flight however few io
+ * threads there are, while opening, which has no asynchronous form here, is
+ * offloaded to the pool's blocking threads. A scan that gets to a page before
+ * its read is done waits for it in a page fault, holding an executor thread.
+*/
+struct CoroCrawl
+{
+  /**
+   * @brief A coroutine that is started by spawn() and frees itself when it
+   * ends
+  */
+  struct FileTask
+  {
+    struct promise_type
+    {
+      FileTask get_return_object() {
+        return { std::coroutine_handle<promise_type>::from_promise(*this) };
+      }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> handle;
+  };
+
+  /**
+   * @brief Awaits one file being opened and its read started, resuming on
+   * the executor with the open file (or -1)
+  */
+  struct Read
+  {
+    CoroCrawl &crawl;
+    const char *file;
+    std::string *path;
+    int fd = -1;
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+      crawl.io.submit([this, h]() {
+        crawl.acquireOpen();
+        fd = openFile(crawl.graph.dirs, file, path);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0)
+          posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED); // starts the read
+        crawl.resume(h);
+      });
+    }
+    int await_resume() { return fd; }
+  };
+
+  static const int MAX_OPEN = 256; // files being read or not yet scanned
+
+  DependencyGraph &graph;
+  ThreadPool &exec;
+  ThreadPool io;
+  std::atomic<long> live{0}; // FileTasks not yet finished
+  int open = 0;
+  std::mutex m;
+  std::condition_variable cv;     // signals live reaching 0
+  std::condition_variable openCv; // signals open dropping below MAX_OPEN
+
+  CoroCrawl(DependencyGraph &g, ThreadPool &e, int ioThreads)
+    : graph(g), exec(e), io(ThreadPool::Options{ ioThreads, ThreadPool::AFFINITY_NONE, ThreadPool::IDLE_BLOCK }) {}
+
+  // continue a coroutine on an executor thread
+  void resume(std::coroutine_handle<> h) {
+    exec.submit([h]() {
+      if (crawlStats.enabled && !myStats)
+        crawlStats.registerThread();
+      h.resume();
+      if (myStats)
+        myStats->endNs = nowNs();
+    });
+  }
+
+  // wait for a free open file, so reads cannot run out of descriptors
+  void acquireOpen() {
+    std::unique_lock<std::mutex> lock(m);
+    openCv.wait(lock, [this]() { return open < MAX_OPEN; });
+    open++;
+  }
+
+  void releaseOpen() {
+    std::unique_lock<std::mutex> lock(m);
+    open--;
+    openCv.notify_one();
+  }
+
+  // 4a&b. process one file
+  FileTask crawlFile(std::string name) {
+    std::string path;
+    int fd = co_await Read{ *this, name.c_str(), &path };
+    graph.processOpened(name.c_str(), fd, path, graph.theTable.get(name),
+                        [this](std::string_view child) { spawn(std::string(child)); });
+    releaseOpen();
+    finish();
+  }
+
+  // start processing a file
+  void spawn(const std::string &name) {
+    live++;
+    resume(crawlFile(name).handle);
+  }
+
+  void finish() {
+    std::unique_lock<std::mutex> lock(m);
+    if (--live == 0)
+      cv.notify_all();
+  }
+
+  /**
+   * @brief Processes everything on the workQ, and everything it includes
+   * 
+   * @return void
+  */
+  void run() {
+    std::string name;
+    live++; // so the count cannot reach 0 while the workQ is being emptied
+    while ((name = graph.workQ.pop_front()) != "") {
+      graph.workQ.done();
+      spawn(name);
+    }
+    finish();
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [this]() { return live == 0; });
+  }
+};
+#endif
+
+// 4. process everything on the workQ with the pool's threads (none = sequentially)
+void DependencyGraph::crawl(ThreadPool &pool) {
+  if (crawlStats.enabled) {
+    crawlStats.numThreads = pool.size();
+    crawlStats.startNs = nowNs();
+  }
+#ifdef CRAWLER_COROUTINES
+  if (coroIoThreads > 0 && pool.size() > 0) {
+    CoroCrawl coro(*this, pool, coroIoThreads);
+    coro.run();
+    workQ.clear();
+    if (crawlStats.enabled)
+      crawlStats.endNs = nowNs();
+    return;
+  }
+#endif
+  if (prefetcher.numThreads > 0)
+    prefetcher.start();
+  // 3.6. Start do_work on every thread (or, with none, run it here)
+  std::vector<std::future<void>> wfutures;
+  for (size_t i = 0; i < std::max<size_t>(pool.size(), 1); i++)
+    wfutures.push_back(pool.submit([this]() { do_work(); }));
+  // 3.7. Wait for the threads to finish
+  for (auto &f : wfutures)
+    f.get();
+  if (prefetcher.numThreads > 0)
+    prefetcher.stop();
+  workQ.clear();
+  if (crawlStats.enabled)
+    crawlStats.endNs = nowNs();
+}
+
+/**
+ * @brief The multi-process crawl, used when CRAWLER_PROCS is set
+ * 
+ * CRAWLER_PROCS worker processes are forked, sharing one memfd segment of
+ * CRAWLER_SHM_MB megabytes (default 1024, allocated only as it is touched)
+ * that holds the whole crawl: names, nodes, edges and a hash table from name
+ * to node, carved from the segment by a bump allocator. Each process has its
+ * own heap, so no allocator or page table is shared, and a process that
+ * crashes loses only the file it was on.
+ * 
+ * Nodes are numbered as they are made, which is also the work order: each
+ * worker claims the first QUEUED node by a compare and swap of its state to
+ * CLAIMED + the worker's number, having noted the node in current[] first,
+ * so that a worker that dies never takes a claim with it: the worker that
+ * replaces it finds the claim there and carries on with it, unless the node
+ * had been started (started[]), in which case it is taken to be what killed
+ * the worker and is finished with no dependencies. A node is made by a
+ * compare and swap of the next number's state from FREE to MAKING + the
+ * worker's number, writing the node, and then claiming its name's hash slot
+ * with a compare and swap; the loser of a race marks its node DEAD, which
+ * workers skip. A node a dead worker was making is finished for it by the
+ * parent: QUEUED if its slot was claimed, else DEAD. The crawl is over once
+ * every node made is DONE or DEAD, so each step a worker can die between
+ * leaves something the parent or a replacement can finish.
+ * 
+ * Once the workers have stopped, the parent copies the graph into theTable.
+ * With CRAWLER_CACHE, each worker hands back the cache entries it changed
+ * with the node they came from; with CRAWLER_STATS, each keeps its
+ * WorkerStats in the segment, and the wait for a node counts as queue wait.
+*/
+struct SharedCrawl
+{
+  static const int MAX_PROCS = 256;
+  // CLAIMED + worker, MAKING + worker
+  enum State { FREE, QUEUED, DONE, DEAD, CLAIMED, MAKING = CLAIMED + MAX_PROCS };
+
+  struct Node {
+    std::atomic<uint32_t> state;
+    uint32_t nameLen;
+    uint64_t name;   // offset of the name
+    uint64_t deps;   // offset of the ids of the files it includes
+    uint32_t ndeps;
+    int32_t sys;     // its node in sysIndex, or -1
+    uint64_t dev, ino;
+    uint64_t cache;  // offset of the cache entries changed processing it
+    uint64_t cacheLen;
+  };
+  struct Header {
+    std::atomic<uint64_t> top;       // the bump allocator's next free byte
+    std::atomic<uint32_t> nodes;     // node numbers handed out (one more may be MAKING)
+    std::atomic<uint32_t> cursor;    // no node before it is queued or being written
+    std::atomic<uint32_t> settled;   // no node before it is not DONE or DEAD
+    std::atomic<uint32_t> epoch;     // futex word, bumped on every change
+    std::atomic<uint32_t> full;      // set when the segment ran out
+    uint32_t maxNodes;
+    uint32_t slotMask;
+    uint64_t size;
+    uint64_t nodesOff;
+    uint64_t slotsOff;
+    std::atomic<uint32_t> current[MAX_PROCS]; // the node each worker claims, + 1
+    std::atomic<uint32_t> started[MAX_PROCS]; // current[], once it is being processed
+    WorkerStats stats[MAX_PROCS];             // with CRAWLER_STATS
+  };
+
+  DependencyGraph &graph;
+  char *base = nullptr;
+  Header *hdr = nullptr;
+  Node *nodes = nullptr;
+  std::atomic<uint32_t> *slots = nullptr; // node + 1, or 0 if empty
+
+  explicit SharedCrawl(DependencyGraph &g) : graph(g) {}
+
+  /**
+   * @brief Makes the segment
+   * 
+   * @param mb Its size in megabytes
+   * @return bool False if it could not be made
+  */
+  bool create(uint64_t mb) {
+    uint64_t size = mb << 20;
+    int fd = memfd_create("dependencyDiscoverer", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+      if (fd >= 0)
+        close(fd);
+      return false;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+      return false;
+    base = (char *)p;
+    hdr = (Header *)base;
+    // about a quarter of the segment for nodes and slots, the rest for names
+    // and edges
+    hdr->size = size;
+    hdr->maxNodes = size / 4 / (sizeof(Node) + 2 * sizeof(uint32_t));
+    uint32_t slotCount = 1;
+    while (slotCount < 2 * hdr->maxNodes)
+      slotCount <<= 1;
+    hdr->slotMask = slotCount - 1;
+    hdr->nodesOff = (sizeof(Header) + 7) & ~7ULL;
+    hdr->slotsOff = hdr->nodesOff + (uint64_t)hdr->maxNodes * sizeof(Node);
+    hdr->top = hdr->slotsOff + (uint64_t)slotCount * sizeof(uint32_t);
+    nodes = (Node *)(base + hdr->nodesOff);
+    slots = (std::atomic<uint32_t> *)(base + hdr->slotsOff);
+    return hdr->top < size;
+  }
+
+  // take n bytes from the segment, or return 0 (and stop the crawl) if full
+  uint64_t alloc(uint64_t n) {
+    uint64_t off = hdr->top.fetch_add((n + 7) & ~7ULL);
+    if (off + n > hdr->size) {
+      hdr->full = 1;
+      wake();
+      return 0;
+    }
+    return off;
+  }
+
+  void wake() {
+    hdr->epoch++;
+    syscall(SYS_futex, &hdr->epoch, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+
+  std::string name(uint32_t id) const {
+    return std::string(base + nodes[id].name, nodes[id].nameLen);
+  }
+
+  /**
+   * @brief Finds the node of a name, making it (and queueing it) if new
+   * 
+   * @param w The worker making it (0 in the parent, before any is forked)
+   * @param name The name
+   * @param sys Its node in sysIndex, or -1
+   * @param id Set to the node
+   * @return bool False if the segment is full
+  */
+  bool intern(int w, std::string_view name, int32_t sys, uint32_t *id) {
+    uint64_t h = hashBytes(name.data(), name.size());
+    uint32_t fresh = UINT32_MAX;
+    for (uint32_t i = h & hdr->slotMask; ; i = (i + 1) & hdr->slotMask) {
+      uint32_t s = slots[i].load();
+      if (s == 0) {
+        if (fresh == UINT32_MAX) {
+          // take the next number by marking its node as ours, so a node is
+          // never without a known maker, then move nodes past it (as anyone
+          // finding it taken does too)
+          while (fresh == UINT32_MAX) {
+            uint32_t next = hdr->nodes.load();
+            if (next >= hdr->maxNodes) {
+              hdr->full = 1;
+              wake();
+              return false;
+            }
+            uint32_t state = FREE;
+            if (nodes[next].state.compare_exchange_strong(state, MAKING + w))
+              fresh = next;
+            hdr->nodes.compare_exchange_strong(next, next + 1);
+          }
+          // write the node before it can be found
+          uint64_t off = alloc(name.size());
+          if (off == 0)
+            return false;
+          memcpy(base + off, name.data(), name.size());
+          Node &n = nodes[fresh];
+          n.nameLen = name.size();
+          n.name = off;
+          n.sys = sys;
+        }
+        if (!slots[i].compare_exchange_strong(s, fresh + 1)) {
+          i = (i - 1) & hdr->slotMask; // look at this slot again
+          continue;
+        }
+        nodes[fresh].state = QUEUED;
+        wake();
+        *id = fresh;
+        return true;
+      }
+      const Node &n = nodes[s - 1];
+      if (n.nameLen == name.size() && memcmp(base + n.name, name.data(), name.size()) == 0) {
+        if (fresh != UINT32_MAX) {
+          nodes[fresh].state = DEAD; // another process made it first
+          wake();
+        }
+        *id = s - 1;
+        return true;
+      }
+    }
+  }
+
+  /**
+   * @brief Finds the includes of one node and stores them
+   * 
+   * @param w The worker
+   * @param id The node
+   * @return bool False if the segment is full
+  */
+  bool process(int w, uint32_t id) {
+    Node &n = nodes[id];
+    std::string file = name(id);
+    std::vector<uint32_t> deps;
+    uint32_t dep;
+    if (myStats)
+      myStats->files++;
+    if (n.sys >= 0) {
+      // a system header, with its includes in the index
+      for (uint32_t e : sysIndex.edgesOf(n.sys)) {
+        if (!intern(w, sysIndex.path(e), e, &dep))
+          return false;
+        deps.push_back(dep);
+      }
+    } else {
+      std::string path;
+      uint64_t t0 = myStats ? nowNs() : 0;
+      int fd = openFile(graph.dirs, file.c_str(), &path);
+      if (myStats)
+        myStats->openNs += nowNs() - t0;
+      const std::vector<std::string> *grammarsOf = graph.generatedBy(file.c_str());
+      if (fd < 0 && !grammarsOf) {
+        fprintf(stderr, "Error opening %s\n", file.c_str());
+        return true;
+      }
+      if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+          n.dev = st.st_dev;
+          n.ino = st.st_ino;
+        }
+        ScanScope scan;
+        std::pmr::vector<std::pmr::string> includes(scan.resource());
+        std::string guard;
+        if (!readIncludes(fd, path, file.c_str(), graph.dirs, graph.opts, graph.opts.macros,
+                          depCache.enabled,
+                          [this](const std::string &name) { return graph.factTable.get(name); },
+                          &includes, &guard))
+          return true;
+        for (auto &inc : includes) {
+          long sys = -1;
+          if (inc[0] == '<') {
+            sys = sysIndex.find(std::string_view(inc).substr(1, inc.size() - 2));
+            if (sys < 0)
+              continue; // not in any system directory
+          }
+          if (!intern(w, sys < 0 ? std::string_view(inc) : sysIndex.path(sys), sys, &dep))
+            return false;
+          deps.push_back(dep);
+        }
+      }
+      // with --grammar, a file yacc or lex makes depends on its grammars
+      if (grammarsOf) {
+        for (auto &g : *grammarsOf) {
+          if (!intern(w, g, -1, &dep))
+            return false;
+          deps.push_back(dep);
+        }
+      }
+    }
+    if (!deps.empty()) {
+      uint64_t off = alloc(deps.size() * sizeof(uint32_t));
+      if (off == 0)
+        return false;
+      memcpy(base + off, deps.data(), deps.size() * sizeof(uint32_t));
+      n.deps = off;
+    }
+    n.ndeps = deps.size();
+    // the cache entries this changed, for the parent to save
+    if (depCache.journaling) {
+      std::string entries = depCache.takeJournal();
+      uint64_t off = entries.empty() ? 0 : alloc(entries.size());
+      if (!entries.empty() && off == 0)
+        return false;
+      memcpy(base + off, entries.data(), entries.size());
+      n.cache = off;
+      n.cacheLen = entries.size();
+    }
+    return true;
+  }
+
+  // mark a node done, in one step so that a worker dying cannot half do it
+  void finish(uint32_t id) {
+    nodes[id].state = DONE;
+    wake();
+  }
+
+  /**
+   * @brief Whether every node made is DONE or DEAD, so no more can be made
+   * 
+   * @return bool True once the crawl is over
+  */
+  bool settled() {
+    uint32_t made = hdr->nodes.load();
+    for (uint32_t i = hdr->settled.load(); i < made; i++) {
+      uint32_t state = nodes[i].state.load();
+      if (state != DONE && state != DEAD)
+        return false;
+      uint32_t at = i;
+      hdr->settled.compare_exchange_strong(at, i + 1);
+    }
+    // a node is made while another is claimed, so none was made unseen
+    return hdr->nodes.load() == made;
+  }
+
+  /**
+   * @brief Claims the first queued node, waiting for one to be made
+   * 
+   * @param w The worker's number
+   * @param id Set to the node claimed
+   * @return int -1 with a node claimed, or else the worker's exit status
+  */
+  int claim(int w, uint32_t *id) {
+    for (;;) {
+      uint32_t e = hdr->epoch.load();
+      if (hdr->full)
+        return 2;
+      uint32_t end = hdr->nodes.load();
+      bool writing = false; // some node before i is still being made
+      for (uint32_t i = hdr->cursor.load(); i < end; i++) {
+        uint32_t state = nodes[i].state.load();
+        if (state == QUEUED) {
+          hdr->current[w] = i + 1; // before the claim, so a death after it loses nothing
+          if (nodes[i].state.compare_exchange_strong(state, CLAIMED + w)) {
+            *id = i;
+            return -1;
+          }
+        }
+        if (state >= MAKING) {
+          writing = true;
+        } else if (!writing && state != QUEUED) {
+          uint32_t at = i;
+          hdr->cursor.compare_exchange_strong(at, i + 1);
+        }
+      }
+      if (settled())
+        return 0;
+      struct timespec timeout = { 0, 10000000 };
+      uint64_t t0 = myStats ? nowNs() : 0;
+      syscall(SYS_futex, &hdr->epoch, FUTEX_WAIT, e, &timeout, NULL, 0);
+      if (myStats)
+        myStats->queueWaitNs += nowNs() - t0;
+    }
+  }
+
+  /**
+   * @brief The body of worker process w
+   * 
+   * @param w The worker's number
+   * @return int Its exit status
+  */
+  int work(int w) {
+    if (crawlStats.enabled) {
+      // a replacement carries on with the stats of the worker it replaces
+      myStats = &hdr->stats[w];
+      if (myStats->startNs == 0)
+        myStats->startNs = nowNs();
+    }
+    depCache.journaling = depCache.enabled;
+    for (;;) {
+      // a worker replacing one that died takes over the node it had claimed
+      uint32_t id = hdr->current[w].load() - 1;
+      if (id >= hdr->maxNodes || nodes[id].state.load() != CLAIMED + (uint32_t)w) {
+        int status = claim(w, &id);
+        if (status >= 0) {
+          if (myStats)
+            myStats->endNs = nowNs();
+          return status;
+        }
+      }
+      hdr->started[w] = id + 1;
+      if (!process(w, id))
+        return 2;
+      finish(id);
+      hdr->started[w] = 0;
+      hdr->current[w] = 0;
+    }
+  }
+
+  // start worker w in a new process
+  static pid_t spawn(SharedCrawl *crawl, int w) {
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0)
+      _exit(crawl->work(w));
+    return pid;
+  }
+
+  /**
+   * @brief Finishes the node a dead worker was making: QUEUED if it can be
+   * found (its slot was claimed, so it was wholly written), else DEAD
+   * 
+   * @param w The dead worker, not yet replaced
+   * @return void
+  */
+  void orphan(int w) {
+    uint32_t end = std::min(hdr->nodes.load() + 1, hdr->maxNodes);
+    for (uint32_t i = hdr->settled.load(); i < end; i++) {
+      uint32_t making = MAKING + w;
+      if (nodes[i].state.load() != making)
+        continue;
+      // the name is written before the slot is claimed, so only look it up
+      // if it is all there
+      const Node &n = nodes[i];
+      bool found = false;
+      if (n.name != 0 && n.name + n.nameLen <= hdr->size) {
+        uint64_t h = hashBytes(base + n.name, n.nameLen);
+        for (uint32_t k = h & hdr->slotMask; slots[k].load() != 0 && !found; k = (k + 1) & hdr->slotMask)
+          found = slots[k].load() == i + 1;
+      }
+      nodes[i].state.compare_exchange_strong(making, found ? (uint32_t)QUEUED : (uint32_t)DEAD);
+      uint32_t at = i;
+      hdr->nodes.compare_exchange_strong(at, i + 1);
+    }
+    wake();
+  }
+
+  /**
+   * @brief Crawls the workQ's files with n worker processes and copies the
+   * result into theTable
+   * 
+   * @param n The number of processes
+   * @return bool False if the crawl could not be done
+  */
+  bool run(int n) {
+    n = std::min(n, (int)MAX_PROCS);
+    if (crawlStats.enabled) {
+      crawlStats.numThreads = n;
+      crawlStats.startNs = nowNs();
+    }
+    std::string file;
+    uint32_t id;
+    while ((file = graph.workQ.pop_front()) != "") {
+      graph.workQ.done();
+      if (!intern(0, file, -1, &id))
+        break;
+    }
+    std::unordered_map<pid_t, int> workers;
+    bool forked = true; // false if the crawl was stopped for want of a process
+    for (int w = 0; w < n && !hdr->full; w++) {
+      pid_t pid = spawn(this, w);
+      if (pid < 0) {
+        perror("fork");
+        forked = false;
+        hdr->full = 1; // stops the others
+        wake();
+        break;
+      }
+      workers[pid] = w;
+    }
+    // 1. wait for the workers, replacing any that crashed
+    bool ok = true;
+    while (!workers.empty()) {
+      int status;
+      pid_t pid = waitpid(-1, &status, 0);
+      if (pid < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      auto it = workers.find(pid);
+      if (it == workers.end())
+        continue;
+      int w = it->second;
+      workers.erase(it);
+      if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        continue;
+      if (WIFEXITED(status) && WEXITSTATUS(status) == 2) {
+        ok = false; // out of space: the others stop too
+        continue;
+      }
+      orphan(w);
+      uint32_t cur = hdr->current[w].load();
+      if (cur != 0 && cur <= hdr->maxNodes && hdr->started[w].exchange(0) == cur &&
+          nodes[cur - 1].state.load() == CLAIMED + (uint32_t)w) {
+        // the file it was on gets no dependencies, and the crawl goes on
+        fprintf(stderr, "Worker crashed while processing %s\n", name(cur - 1).c_str());
+        nodes[cur - 1].ndeps = 0;
+        nodes[cur - 1].cacheLen = 0;
+        finish(cur - 1);
+        hdr->current[w] = 0;
+      }
+      // otherwise its replacement takes over any node it had claimed
+      if (!settled() && !hdr->full) {
+        pid_t again = spawn(this, w);
+        if (again < 0) {
+          perror("fork");
+          forked = false;
+          hdr->full = 1; // stops the others, as no one could take the claim
+          wake();
+        } else {
+          workers[again] = w;
+        }
+      }
+    }
+    if (crawlStats.enabled) {
+      crawlStats.endNs = nowNs();
+      for (int w = 0; w < n; w++) {
+        if (hdr->stats[w].startNs != 0)
+          crawlStats.workers.push_back(std::make_unique<WorkerStats>(hdr->stats[w]));
+      }
+    }
+    if (hdr->full) {
+      if (forked)
+        fprintf(stderr, "Shared segment full - set CRAWLER_SHM_MB above %" PRIu64 "\n",
+                hdr->size >> 20);
+      return false;
+    }
+    // 2. copy the graph into theTable (keeping the foo.o entries), and the
+    // cache entries the workers changed into depCache
+    uint32_t count = hdr->nodes.load();
+    for (uint32_t i = 0; i < count; i++) {
+      const Node &nd = nodes[i];
+      if (nd.state.load() != DONE)
+        continue;
+      DepList deps(graph.theTable.resource());
+      const uint32_t *d = (const uint32_t *)(base + nd.deps);
+      for (uint32_t k = 0; k < nd.ndeps; k++)
+        deps.emplace_back(base + nodes[d[k]].name, nodes[d[k]].nameLen);
+      std::string nm = name(i);
+      if (nd.dev || nd.ino) {
+        struct stat st;
+        st.st_dev = nd.dev;
+        st.st_ino = nd.ino;
+        graph.fileIds.bind(nm, FileIds::idOf(st));
+      }
+      graph.theTable.get(nm)->swap(deps);
+      if (nd.cacheLen > 0) {
+        FILE *fd = fmemopen(base + nd.cache, nd.cacheLen, "r");
+        if (fd) {
+          depCache.readEntries(fd, true);
+          fclose(fd);
+        }
+      }
+    }
+    return ok;
+  }
+
+  ~SharedCrawl() {
+    if (base)
+      munmap(base, hdr->size);
+  }
+};
+
+/**
+ * @brief Brings the table up to date after files have changed, rescanning
+ * only the names read from them
+ * 
+ * A changed path that was read and is still in its directory only has new
+ * content, so just the names it was read as are rescanned. A path that came
+ * or went (by its directory's listing) may change which file a name finds,
+ * so every name ending in its last part is rescanned as well. Each rescanned
+ * list is compared with its old one, and files newly included are crawled as
+ * usual. trackOrigins must have been set since the first crawl.
+ * 
+ * @param changed The changed paths, each a search directory and a name
+ * @param pool The threads to crawl with
+ * @return std::vector<std::string> The keys whose lists changed, sorted
+*/
+std::vector<std::string> DependencyGraph::update(const std::vector<std::string> &changed,
+                                                 ThreadPool &pool) {
+  // 1. find the names read from each path, and those that may find another file
+  std::unordered_set<std::string> dirty;
+  bool moved = false;
+  for (auto &path : changed) {
+    auto oit = origins.theTable.find(origins.key(path));
+    if (oit != origins.theTable.end()) {
+      for (auto &key : oit->second)
+        dirty.emplace(key);
+      origins.theTable.erase(oit); // the rescan records them again
+    }
+    struct stat st;
+    if (!dirCache.stale(path, stat(path.c_str(), &st) == 0))
+      continue;
+    moved = true;
+    std::string name = path.substr(path.rfind('/') + 1);
+    for (auto &p : theTable.theTable) {
+      std::string_view key(p.first);
+      if (key == name || (key.size() > name.size() &&
+          key.compare(key.size() - name.size(), name.size(), name) == 0 &&
+          key[key.size() - name.size() - 1] == '/'))
+        dirty.emplace(key);
+    }
+  }
+  if (moved)
+    dirCache.revalidate();
+  // 2. forget what was read for each, keeping its list to compare, and queue it
+  // (and with --conditional, what any header was found to change)
+  std::unordered_map<std::string, std::vector<std::string>> before;
+  if (!dirty.empty())
+    factTable.clear();
+  for (auto &key : dirty) {
+    auto it = theTable.theTable.find(theTable.key(key));
+    if (it == theTable.theTable.end() || targets.count(key))
+      continue;
+    before[key].assign(it->second.begin(), it->second.end());
+    it->second.clear();
+    fileIds.reads.erase(fileIds.keyOf(key));
+    workQ.push_stable(it->first);
+  }
+  // 3. rescan them, and crawl whatever they now include that is new
+  crawl(pool);
+  // 4. compare the lists
+  std::vector<std::string> diff;
+  for (auto &b : before) {
+    const DepList &now = *theTable.get(b.first);
+    if (!std::equal(now.begin(), now.end(), b.second.begin(), b.second.end(),
+                    [](std::string_view x, std::string_view y) { return x == y; }))
+      diff.push_back(b.first);
+  }
+  std::sort(diff.begin(), diff.end());
+  return diff;
+}
+
+// forget everything, as when file system events have been lost
+void DependencyGraph::reset() {
+  theTable.release();
+  origins.release();
+  factTable.clear();
+  fileIds.bySpelling.clear();
+  fileIds.reads.clear();
+  fileIds.arena.release();
+  targets.clear();
+  workQ.clear();
+}
+
+/**
+ * @brief The include graph with every file name interned as a number
+ * 
+ * theTable is frozen into it once the crawl is over, and everything after
+ * (printing, -MMD, -R and the report) reads it, several threads at once.
+ * Edges are in compressed rows: the files node i includes are to[first[i]]
+ * up to (but not including) to[first[i + 1]], 4 bytes an edge against a list
+ * node and a string each in theTable. buildReverse() adds the reverse edges,
+ * the files that include node i, in rfirst and rto. update() redoes the rows
+ * of files whose includes changed, for a graph that is kept.
+*/
+struct IdGraph
+{
+  FileIds *fileIds = nullptr; // of the crawl it was built from
+  std::vector<std::string> names;
+  std::unordered_map<std::string, uint32_t> ids;
+  std::vector<uint32_t> first;
+  std::vector<uint32_t> to;
+  std::vector<uint32_t> objects; // the foo.o nodes of the file arguments
+  std::vector<uint32_t> rfirst;
+  std::vector<uint32_t> rto;
+  // the few edges naming their file by another spelling than names[], and
+  // those spellings
+  std::unordered_map<uint32_t, uint32_t> edgeSpelling;
+  std::vector<std::string> spellings;
+  std::unordered_map<std::string, uint32_t> bySpelling; // made by update()
+
+  // the spellings of one file share a node, named by the first interned
+  uint32_t intern(const std::string &name) {
+    auto ins = ids.insert({ fileIds->keyOf(name), (uint32_t)names.size() });
+    if (ins.second)
+      names.push_back(name);
+    return ins.first->second;
+  }
+
+  /**
+   * @brief Copies a crawl's table, numbering files in name order
+   * 
+   * @param g The crawl
+   * @param files The file arguments
+   * @return void
+  */
+  void build(DependencyGraph &g, const std::vector<const char *> &files) {
+    fileIds = &g.fileIds;
+    std::vector<std::pair<std::string, const DepList *>> keys;
+    for (auto &p : g.theTable.theTable)
+      keys.push_back({ std::string(p.first), &p.second });
+    std::sort(keys.begin(), keys.end());
+    std::vector<uint32_t> node;
+    for (auto &k : keys)
+      node.push_back(intern(k.first));
+    std::vector<std::vector<uint32_t>> out(names.size());
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> aliases(names.size());
+    std::vector<bool> done(names.size());
+    std::string dep; // each name, in a buffer that is reused
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (done[node[i]])
+        continue; // another spelling of a file already copied
+      done[node[i]] = true;
+      for (auto &spelling : *keys[i].second) {
+        dep.assign(spelling);
+        uint32_t v = intern(dep);
+        out.resize(names.size());
+        aliases.resize(names.size());
+        if (names[v] != dep) {
+          aliases[node[i]].push_back({ (uint32_t)out[node[i]].size(), (uint32_t)spellings.size() });
+          spellings.push_back(dep);
+        }
+        out[node[i]].push_back(v);
+      }
+    }
+    out.resize(names.size()); // names only ever included, if any
+    aliases.resize(names.size());
+    for (size_t u = 0; u < out.size(); u++) {
+      for (auto &a : aliases[u])
+        edgeSpelling[to.size() + a.first] = a.second;
+      first.push_back(to.size());
+      to.insert(to.end(), out[u].begin(), out[u].end());
+      std::vector<uint32_t>().swap(out[u]);
+    }
+    first.push_back(to.size());
+    for (auto f : files) {
+      auto it = ids.find(parseFile(f).first + ".o");
+      if (it != ids.end())
+        objects.push_back(it->second);
+    }
+  }
+
+  /**
+   * @brief Redoes the rows of the files given from the table, after
+   * DependencyGraph::update()
+   * 
+   * Files they now include that the graph has not seen become nodes, with
+   * their rows copied too. The compressed rows are then spliced: every other
+   * row is copied as it is, with no name looked up. The reverse edges, if
+   * built, are rebuilt. Nodes no longer included are kept, with no includers.
+   * 
+   * @param g The crawl the graph was built from
+   * @param keys The keys whose lists changed, and any foo.o keys added since
+   * @return void
+  */
+  void update(DependencyGraph &g, const std::vector<std::string> &keys) {
+    // 1. every spelling in the graph, the first time
+    if (bySpelling.empty()) {
+      for (uint32_t u = 0; u < names.size(); u++)
+        bySpelling.insert({ names[u], u });
+      for (auto &e : edgeSpelling)
+        bySpelling.insert({ spellings[e.second], to[e.first] });
+    }
+    // a spelling keeps its node; a new one joins the node of its file only if
+    // that node's name still names the same file, as an identity can be
+    // reused once its file is deleted
+    size_t old = names.size();
+    auto nodeOf = [this](const std::string &name, bool *fresh) {
+      std::string id = fileIds->keyOf(name);
+      *fresh = false;
+      auto it = bySpelling.find(name);
+      if (it == bySpelling.end()) {
+        auto j = ids.find(id);
+        uint32_t u;
+        if (j != ids.end() && fileIds->keyOf(names[j->second]) == id) {
+          u = j->second;
+        } else {
+          u = names.size();
+          names.push_back(name);
+          *fresh = true;
+        }
+        it = bySpelling.insert({ name, u }).first;
+      }
+      ids[id] = it->second;
+      return it->second;
+    };
+    // 2. the new rows, by breadth first search from the keys into new files
+    std::unordered_map<uint32_t, std::vector<uint32_t>> rows;
+    std::unordered_map<uint32_t, std::vector<std::pair<uint32_t, uint32_t>>> aliases;
+    std::vector<std::string> work(keys.begin(), keys.end());
+    std::string dep; // each name, in a buffer that is reused
+    for (size_t i = 0; i < work.size(); i++) {
+      bool fresh;
+      uint32_t u = nodeOf(work[i], &fresh);
+      if (!rows.insert({ u, {} }).second)
+        continue; // another spelling of a file already done
+      if (u >= old && g.targets.count(work[i]))
+        objects.push_back(u);
+      auto it = g.theTable.theTable.find(g.theTable.key(work[i]));
+      if (it == g.theTable.theTable.end())
+        continue;
+      std::vector<uint32_t> &out = rows[u];
+      for (auto &spelling : it->second) {
+        dep.assign(spelling);
+        uint32_t v = nodeOf(dep, &fresh);
+        if (fresh)
+          work.push_back(dep); // new to the graph
+        if (names[v] != dep) {
+          aliases[u].push_back({ (uint32_t)out.size(), (uint32_t)spellings.size() });
+          spellings.push_back(dep);
+        }
+        out.push_back(v);
+      }
+    }
+    // 3. splice them into the compressed rows
+    std::vector<uint32_t> nfirst;
+    std::vector<uint32_t> nto;
+    nfirst.reserve(names.size() + 1);
+    nto.reserve(to.size());
+    std::unordered_map<uint32_t, uint32_t> nspelling;
+    for (uint32_t u = 0; u < names.size(); u++) {
+      nfirst.push_back(nto.size());
+      auto r = rows.find(u);
+      if (r != rows.end()) {
+        for (auto &a : aliases[u])
+          nspelling[nto.size() + a.first] = a.second;
+        nto.insert(nto.end(), r->second.begin(), r->second.end());
+      } else if (u < old) {
+        nto.insert(nto.end(), to.begin() + first[u], to.begin() + first[u + 1]);
+      }
+    }
+    nfirst.push_back(nto.size());
+    // the other rows' spellings move with their rows
+    for (auto &e : edgeSpelling) {
+      uint32_t u = std::upper_bound(first.begin(), first.end(), e.first) - first.begin() - 1;
+      if (!rows.count(u))
+        nspelling[e.first - first[u] + nfirst[u]] = e.second;
+    }
+    first.swap(nfirst);
+    to.swap(nto);
+    edgeSpelling.swap(nspelling);
+    if (!rfirst.empty())
+      buildReverse();
+  }
+
+  // the name of the file edge e includes, as spelled in the including file
+  const std::string &spelling(uint32_t e) const {
+    auto it = edgeSpelling.find(e);
+    return it == edgeSpelling.end() ? names[to[e]] : spellings[it->second];
+  }
+
+  /**
+   * @brief Builds the reverse edges, by counting each file's includers first
+   * 
+   * @return void
+  */
+  void buildReverse() {
+    size_t n = names.size();
+    rfirst.assign(n + 1, 0);
+    for (uint32_t v : to)
+      rfirst[v + 1]++;
+    for (size_t i = 0; i < n; i++)
+      rfirst[i + 1] += rfirst[i];
+    rto.resize(to.size());
+    std::vector<uint32_t> fill(rfirst.begin(), rfirst.end() - 1);
+    for (uint32_t u = 0; u < n; u++)
+      for (uint32_t e = first[u]; e < first[u + 1]; e++)
+        rto[fill[to[e]]++] = u;
+  }
+};
+
+/**
+ * @brief Finds the strongly connected components of a graph with Tarjan's
+ * algorithm, run with an explicit stack so deep include chains are safe
+ * 
+ * @param g The graph
+ * @param comp Set to each node's component; components are numbered in the
+ * order they complete, so every edge goes to a component numbered no higher
+ * @return uint32_t The number of components
+*/
+static uint32_t tarjan(const IdGraph &g, std::vector<uint32_t> *comp) {
+  const uint32_t NONE = UINT32_MAX;
+  size_t n = g.names.size();
+  std::vector<uint32_t> index(n, NONE), low(n, 0);
+  std::vector<bool> onStack(n, false);
+  std::vector<uint32_t> stack;
+  std::vector<std::pair<uint32_t, uint32_t>> calls; // node, next edge
+  uint32_t next = 0, count = 0;
+  comp->assign(n, NONE);
+  for (uint32_t s = 0; s < n; s++) {
+    if (index[s] != NONE)
+      continue;
+    calls.push_back({ s, g.first[s] });
+    index[s] = low[s] = next++;
+    stack.push_back(s);
+    onStack[s] = true;
+    while (!calls.empty()) {
+      uint32_t u = calls.back().first;
+      uint32_t &e = calls.back().second;
+      if (e < g.first[u + 1]) {
+        uint32_t v = g.to[e++];
+        if (index[v] == NONE) {
+          index[v] = low[v] = next++;
+          stack.push_back(v);
+          onStack[v] = true;
+          calls.push_back({ v, g.first[v] });
+        } else if (onStack[v]) {
+          low[u] = std::min(low[u], index[v]);
+        }
+        continue;
+      }
+      // u is finished: close its component if it is the root of one
+      if (low[u] == index[u]) {
+        uint32_t v;
+        do {
+          v = stack.back();
+          stack.pop_back();
+          onStack[v] = false;
+          (*comp)[v] = count;
+        } while (v != u);
+        count++;
+      }
+      calls.pop_back();
+      if (!calls.empty()) {
+        uint32_t p = calls.back().first;
+        low[p] = std::min(low[p], low[u]);
+      }
+    }
+  }
+  return count;
+}
+
+// print a string as a JSON string
+static void jsonString(FILE *fd, const std::string &s) {
+  fputc('"', fd);
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\')
+      fprintf(fd, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(fd, "\\u%04x", c);
+    else
+      fputc(c, fd);
+  }
+  fputc('"', fd);
+}
+
+/**
+ * @brief Writes the include cycles and the most included headers as JSON
+ * 
+ * The report lists every strongly connected component with more than one file
+ * (or a file that includes itself), largest first, each with one cycle
+ * through its first file; and the headers that the most of the file
+ * arguments' objects depend on, directly or not, which are those whose change
+ * recompiles the most. Reach is found by passing sets of objects (as bit
+ * vectors) down the components in topological order.
+ * 
+ * @param g The graph
+ * @param fd Where the report goes
+ * @param top How many components and headers to list
+ * @return void
+*/
+static void writeReport(const IdGraph &g, FILE *fd, size_t top) {
+  size_t n = g.names.size();
+  std::vector<uint32_t> comp;
+  uint32_t ncomp = tarjan(g, &comp);
+  std::vector<std::vector<uint32_t>> members(ncomp);
+  for (uint32_t v = 0; v < n; v++)
+    members[comp[v]].push_back(v); // in name order, as ids are
+  std::vector<bool> selfLoop(ncomp, false);
+  for (uint32_t v = 0; v < n; v++)
+    for (uint32_t e = g.first[v]; e < g.first[v + 1]; e++)
+      if (g.to[e] == v)
+        selfLoop[comp[v]] = true;
+
+  // 1. the cyclic components, largest first
+  std::vector<uint32_t> cyclic;
+  for (uint32_t c = 0; c < ncomp; c++)
+    if (members[c].size() > 1 || selfLoop[c])
+      cyclic.push_back(c);
+  std::sort(cyclic.begin(), cyclic.end(), [&](uint32_t a, uint32_t b) {
+    if (members[a].size() != members[b].size())
+      return members[a].size() > members[b].size();
+    return members[a][0] < members[b][0];
+  });
+  fprintf(fd, "{\"files\": %zu, \"includes\": %zu, \"cycles\": %zu, \"largest\": [",
+          n, g.to.size(), cyclic.size());
+  std::vector<uint32_t> parent(n);
+  for (size_t k = 0; k < cyclic.size() && k < top; k++) {
+    uint32_t c = cyclic[k];
+    // breadth first from the first member, inside the component, back to it
+    uint32_t start = members[c][0];
+    std::unordered_set<uint32_t> seen = { start };
+    std::list<uint32_t> frontier = { start };
+    uint32_t last = start;
+    bool found = false;
+    while (!found && !frontier.empty()) {
+      uint32_t u = frontier.front();
+      frontier.pop_front();
+      for (uint32_t e = g.first[u]; e < g.first[u + 1] && !found; e++) {
+        uint32_t v = g.to[e];
+        if (v == start) {
+          last = u;
+          found = true;
+        } else if (comp[v] == c && seen.insert(v).second) {
+          parent[v] = u;
+          frontier.push_back(v);
+        }
+      }
+    }
+    std::vector<uint32_t> cycle = { start };
+    for (uint32_t v = last; v != start; v = parent[v])
+      cycle.push_back(v);
+    cycle.push_back(start);
+    std::reverse(cycle.begin() + 1, cycle.end() - 1);
+    fprintf(fd, "%s\n  {\"size\": %zu, \"members\": [", k ? "," : "", members[c].size());
+    for (size_t i = 0; i < members[c].size(); i++) {
+      fprintf(fd, "%s", i ? ", " : "");
+      jsonString(fd, g.names[members[c][i]]);
+    }
+    fprintf(fd, "], \"cycle\": [");
+    for (size_t i = 0; i < cycle.size(); i++) {
+      fprintf(fd, "%s", i ? ", " : "");
+      jsonString(fd, g.names[cycle[i]]);
+    }
+    fprintf(fd, "]}");
+  }
+
+  // 2. which objects reach each component: components complete sinks first,
+  //    so going from the last to the first visits every includer before
+  //    what it includes
+  size_t words = (g.objects.size() + 63) / 64;
+  std::vector<uint64_t> reach(ncomp * words, 0);
+  for (size_t t = 0; t < g.objects.size(); t++)
+    reach[comp[g.objects[t]] * words + t / 64] |= 1ULL << (t % 64);
+  for (uint32_t c = ncomp; c-- > 0; ) {
+    for (uint32_t u : members[c]) {
+      for (uint32_t e = g.first[u]; e < g.first[u + 1]; e++) {
+        uint32_t d = comp[g.to[e]];
+        if (d != c)
+          for (size_t w = 0; w < words; w++)
+            reach[d * words + w] |= reach[c * words + w];
+      }
+    }
+  }
+  std::vector<std::pair<size_t, uint32_t>> fanIn;
+  for (uint32_t v = 0; v < n; v++) {
+    std::string ext = parseFile(g.names[v].c_str()).second;
+    if (ext == "o" || ext == "c" || ext == "y" || ext == "l")
+      continue; // only headers
+    size_t count = 0;
+    for (size_t w = 0; w < words; w++)
+      count += __builtin_popcountll(reach[comp[v] * words + w]);
+    fanIn.push_back({ count, v });
+  }
+  std::sort(fanIn.begin(), fanIn.end(), [](const std::pair<size_t, uint32_t> &a,
+                                           const std::pair<size_t, uint32_t> &b) {
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+  });
+  fprintf(fd, "],\n \"fan_in\": [");
+  for (size_t k = 0; k < fanIn.size() && k < top; k++) {
+    fprintf(fd, "%s\n  {\"file\": ", k ? "," : "");
+    jsonString(fd, g.names[fanIn[k].second]);
+    fprintf(fd, ", \"objects\": %zu}", fanIn[k].first);
+  }
+  fprintf(fd, "]}\n");
+}
+
+/**
+ * @brief Finds everything that depends on a file, directly or not, by a
+ * breadth first search over the reverse edges
+ * 
+ * The search goes a level at a time. A level with at least PARALLEL_LEVEL
+ * files is split between the pool's threads, which claim files with an atomic
+ * exchange on their visited flag, so each file is expanded once; smaller
+ * levels, as in long chains, are expanded by the calling thread alone.
+ * 
+ * @param g The graph, with its reverse edges built
+ * @param start The changed file
+ * @param pool The threads to use for large levels
+ * @param visited One flag per file, all clear; set for every file reached
+ * @return void
+*/
+static void reverseReach(const IdGraph &g, uint32_t start, ThreadPool &pool,
+                         std::vector<std::atomic<bool>> *visited) {
+  const size_t PARALLEL_LEVEL = 1024;
+  std::vector<uint32_t> frontier = { start };
+  (*visited)[start] = true;
+  // expand frontier[i] for i in [b, e) into next
+  auto expand = [&g, visited, &frontier](size_t b, size_t e, std::vector<uint32_t> *next) {
+    for (size_t i = b; i < e; i++) {
+      uint32_t u = frontier[i];
+      for (uint32_t k = g.rfirst[u]; k < g.rfirst[u + 1]; k++) {
+        uint32_t v = g.rto[k];
+        if (!(*visited)[v].load(std::memory_order_relaxed) &&
+            !(*visited)[v].exchange(true))
+          next->push_back(v);
+      }
+    }
+  };
+  while (!frontier.empty()) {
+    std::vector<uint32_t> next;
+    size_t n = pool.size();
+    if (n <= 1 || frontier.size() < PARALLEL_LEVEL) {
+      expand(0, frontier.size(), &next);
+    } else {
+      std::vector<std::vector<uint32_t>> parts(n);
+      std::vector<std::future<void>> done;
+      size_t chunk = (frontier.size() + n - 1) / n;
+      for (size_t t = 0; t < n; t++) {
+        size_t b = std::min(frontier.size(), t * chunk);
+        size_t e = std::min(frontier.size(), b + chunk);
+        done.push_back(pool.submit([&expand, b, e, &parts, t]() { expand(b, e, &parts[t]); }));
+      }
+      for (size_t t = 0; t < n; t++) {
+        done[t].get();
+        next.insert(next.end(), parts[t].begin(), parts[t].end());
+      }
+    }
+    frontier.swap(next);
+  }
+}
+
+/**
+ * @brief Prints the objects that depend on a changed file, in file argument
+ * order
+ * 
+ * The file is found by an include spelling, or else as a path or on the
+ * search path, by its (device, inode) identity (see FileIds).
+ * 
+ * @param g The graph
+ * @param dirs The search path
+ * @param changed The changed file
+ * @param pool The workers for the reverse search
+ * @param fd Where to print
+ * @return bool False, after an error message, if the file is not in the graph
+*/
+static bool printDependents(const IdGraph &g, const std::vector<std::string> &dirs,
+                            const char *changed, ThreadPool &pool, FILE *fd) {
+  auto it = g.ids.find(g.fileIds->keyOf(changed));
+  struct stat st;
+  if (it == g.ids.end() && stat(changed, &st) == 0)
+    it = g.ids.find(FileIds::idOf(st));
+  if (it == g.ids.end()) {
+    std::string path;
+    int file = openFile(dirs, changed, &path);
+    if (file >= 0) {
+      if (fstat(file, &st) == 0)
+        it = g.ids.find(FileIds::idOf(st));
+      close(file);
+    }
+  }
+  if (it == g.ids.end()) {
+    fprintf(stderr, "%s is not included by any file argument\n", changed);
+    return false;
+  }
+  fprintf(fd, "%s:", changed);
+  std::vector<std::atomic<bool>> visited(g.names.size());
+  reverseReach(g, it->second, pool, &visited);
+  for (uint32_t obj : g.objects)
+    if (visited[obj])
+      fprintf(fd, " %s", g.names[obj].c_str());
+  fprintf(fd, "\n");
+  return true;
+}
+
+/**
+ * @brief The marks and queue of a breadth first walk of an IdGraph, kept from
+ * one walk to the next
+ * 
+ * A node is marked when its stamp is the current walk's epoch, so a new walk
+ * starts with nothing marked by bumping the epoch, not by clearing a mark for
+ * every node; printing every file argument so costs what is printed, not the
+ * number of arguments times the size of the graph.
+*/
+struct Walk
+{
+  std::vector<uint32_t> stamp;
+  uint32_t epoch = 0;
+  std::vector<uint32_t> queue;
+
+  // start a walk of g, with no node marked and an empty queue
+  void start(const IdGraph &g) {
+    if (stamp.size() < g.names.size())
+      stamp.resize(g.names.size(), 0);
+    if (++epoch == 0) {
+      // wrapped around: old stamps could match again
+      std::fill(stamp.begin(), stamp.end(), 0);
+      epoch = 1;
+    }
+    queue.clear();
+  }
+
+  // mark a node, returning false if it already was
+  bool mark(uint32_t u) {
+    if (stamp[u] == epoch)
+      return false;
+    stamp[u] = epoch;
+    return true;
+  }
+};
+
+/**
+ * @brief Prints the dependency line of one file argument from the frozen
+ * graph, breadth first, each file once under the first spelling met
+ * 
+ * @param g The graph
+ * @param file The file argument
+ * @param walk The marks and queue to use, shared by the calls of one thread
+ * @param fd Where to print
+ * @return void
+*/
+static void printFrozen(const IdGraph &g, const char *file, Walk *walk, FILE *fd) {
+  std::string obj = parseFile(file).first + ".o";
+  // 5c. print "foo.o:"
+  fprintf(fd, "%s:", obj.c_str());
+  auto it = g.ids.find(obj);
+  if (it != g.ids.end()) {
+    // 5a-b. the files printed, and the queue of those whose includes are not yet
+    walk->start(g);
+    std::vector<uint32_t> &toProcess = walk->queue;
+    walk->mark(it->second);
+    toProcess.push_back(it->second);
+    for (size_t head = 0; head < toProcess.size(); head++) {
+      uint32_t u = toProcess[head];
+      for (uint32_t e = g.first[u]; e < g.first[u + 1]; e++) {
+        if (!walk->mark(g.to[e]))
+          continue;
+        fprintf(fd, " %s", g.spelling(e).c_str());
+        toProcess.push_back(g.to[e]);
+      }
+    }
+  }
+  fprintf(fd, "\n");
+}
+
+/**
+ * @brief A parsed JSON value, enough of JSON for compile_commands.json
+*/
+struct JsonValue
+{
+  enum Type { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT } type = NUL;
+  std::string str; // a string, or the text of a number or boolean
+  std::vector<JsonValue> items;
+  std::vector<std::pair<std::string, JsonValue>> fields;
+
+  // the field with the given name, or NULL
+  const JsonValue *get(const char *name) const {
+    for (auto &f : fields)
+      if (f.first == name)
+        return &f.second;
+    return NULL;
+  }
+};
+
+/**
+ * @brief A recursive descent JSON parser
+*/
+struct JsonParser
+{
+  const char *p;
+  const char *end;
+  int depth = 0;
+
+  void skipSpace() {
+    while (p < end && isspace((unsigned char)*p)) { p++; }
+  }
+
+  // append code point c to s as UTF-8
+  static void utf8(std::string *s, unsigned long c) {
+    if (c < 0x80) {
+      *s += (char)c;
+    } else if (c < 0x800) {
+      *s += (char)(0xc0 | (c >> 6));
+      *s += (char)(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+      *s += (char)(0xe0 | (c >> 12));
+      *s += (char)(0x80 | ((c >> 6) & 0x3f));
+      *s += (char)(0x80 | (c & 0x3f));
+    } else {
+      *s += (char)(0xf0 | (c >> 18));
+      *s += (char)(0x80 | ((c >> 12) & 0x3f));
+      *s += (char)(0x80 | ((c >> 6) & 0x3f));
+      *s += (char)(0x80 | (c & 0x3f));
+    }
+  }
+
+  bool hex4(unsigned long *c) {
+    if (end - p < 4)
+      return false;
+    char buf[5] = { p[0], p[1], p[2], p[3], 0 };
+    char *e;
+    *c = strtoul(buf, &e, 16);
+    p += 4;
+    return e == buf + 4;
+  }
+
+  bool string(std::string *s) {
+    if (p >= end || *p != '"')
+      return false;
+    p++;
+    while (p < end && *p != '"') {
+      if (*p != '\\') {
+        *s += *p++;
+        continue;
+      }
+      if (++p >= end)
+        return false;
+      char c = *p++;
+      switch (c) {
+      case 'b': *s += '\b'; break;
+      case 'f': *s += '\f'; break;
+      case 'n': *s += '\n'; break;
+      case 'r': *s += '\r'; break;
+      case 't': *s += '\t'; break;
+      case 'u': {
+        unsigned long u, lo;
+        if (!hex4(&u))
+          return false;
+        // a surrogate pair is two escapes
+        if (u >= 0xd800 && u < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+          p += 2;
+          if (!hex4(&lo) || lo < 0xdc00 || lo >= 0xe000)
+            return false;
+          u = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+        }
+        utf8(s, u);
+        break;
+      }
+      default: *s += c; break; // '"', '\\' and '/'
+      }
+    }
+    if (p >= end)
+      return false;
+    p++;
+    return true;
+  }
+
+  bool value(JsonValue *v) {
+    skipSpace();
+    if (p >= end || ++depth > 256)
+      return false;
+    bool ok = true;
+    if (*p == '{') {
+      v->type = JsonValue::OBJECT;
+      p++;
+      skipSpace();
+      if (p < end && *p == '}') {
+        p++;
+      } else {
+        for (;;) {
+          std::pair<std::string, JsonValue> f;
+          skipSpace();
+          if (!string(&f.first))
+            return false;
+          skipSpace();
+          if (p >= end || *p++ != ':' || !value(&f.second))
+            return false;
+          v->fields.push_back(std::move(f));
+          skipSpace();
+          if (p < end && *p == ',') { p++; continue; }
+          if (p < end && *p == '}') { p++; break; }
+          return false;
+        }
+      }
+    } else if (*p == '[') {
+      v->type = JsonValue::ARRAY;
+      p++;
+      skipSpace();
+      if (p < end && *p == ']') {
+        p++;
+      } else {
+        for (;;) {
+          v->items.emplace_back();
+          if (!value(&v->items.back()))
+            return false;
+          skipSpace();
+          if (p < end && *p == ',') { p++; continue; }
+          if (p < end && *p == ']') { p++; break; }
+          return false;
+        }
+      }
+    } else if (*p == '"') {
+      v->type = JsonValue::STRING;
+      ok = string(&v->str);
+    } else {
+      const char *q = p;
+      while (p < end && (isalnum((unsigned char)*p) || strchr("+-.", *p))) { p++; }
+      v->str.assign(q, p);
+      if (v->str == "true" || v->str == "false")
+        v->type = JsonValue::BOOL;
+      else if (v->str == "null")
+        v->type = JsonValue::NUL;
+      else if (!v->str.empty() && (isdigit((unsigned char)v->str[0]) || v->str[0] == '-'))
+        v->type = JsonValue::NUMBER;
+      else
+        ok = false;
+    }
+    depth--;
+    return ok;
+  }
+
+  /**
+   * @brief Parses a whole document
+   * 
+   * @param text The document
+   * @param v Set to its value
+   * @return bool False if it is not valid JSON
+  */
+  static bool parse(const std::string &text, JsonValue *v) {
+    JsonParser jp = { text.data(), text.data() + text.size() };
+    if (!jp.value(v))
+      return false;
+    jp.skipSpace();
+    return jp.p == jp.end;
+  }
+};
+
+/**
+ * @brief Splits a compile command into words as a POSIX shell would, with
+ * quotes and backslashes (but no expansions)
+ * 
+ * @param command The command
+ * @return std::vector<std::string> The words
+*/
+static std::vector<std::string> splitCommand(const std::string &command) {
+  std::vector<std::string> words;
+  std::string word;
+  bool inWord = false;
+  for (size_t i = 0; i < command.size(); i++) {
+    char c = command[i];
+    if (c == '\'') {
+      size_t close = command.find('\'', i + 1);
+      if (close == std::string::npos)
+        close = command.size();
+      word += command.substr(i + 1, close - i - 1);
+      i = close;
+      inWord = true;
+    } else if (c == '"') {
+      for (i++; i < command.size() && command[i] != '"'; i++) {
+        if (command[i] == '\\' && i + 1 < command.size() && strchr("\"\\$`", command[i + 1]))
+          i++;
+        word += command[i];
+      }
+      inWord = true;
+    } else if (c == '\\' && i + 1 < command.size()) {
+      word += command[++i];
+      inWord = true;
+    } else if (isspace((unsigned char)c)) {
+      if (inWord)
+        words.push_back(word);
+      word.clear();
+      inWord = false;
+    } else {
+      word += c;
+      inWord = true;
+    }
+  }
+  if (inWord)
+    words.push_back(word);
+  return words;
+}
+
+/**
+ * @brief Computes each value once, however many threads ask for it: the
+ * first asks computes it, the others wait for its result
+*/
+template <typename V>
+struct OnceMap
+{
+  std::unordered_map<std::string, std::shared_future<V>> values;
+  std::mutex m;
+
+  template <typename F>
+  V get(const std::string &key, F compute) {
+    std::promise<V> mine;
+    std::shared_future<V> f;
+    bool owner = false;
+    {
+      std::unique_lock<std::mutex> lock(m);
+      auto it = values.find(key);
+      if (it != values.end()) {
+        f = it->second;
+      } else {
+        f = mine.get_future().share();
+        values.emplace(key, f);
+        owner = true;
+      }
+    }
+    if (owner)
+      mine.set_value(compute());
+    return f.get();
+  }
+
+  // the value of key if it has been computed, without waiting for it
+  bool peek(const std::string &key, V *value) {
+    std::unique_lock<std::mutex> lock(m);
+    auto it = values.find(key);
+    if (it == values.end() || it->second.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+      return false;
+    *value = it->second.get();
+    return true;
+  }
+};
+
+/**
+ * @brief A crawl driven by a compilation database (compile_commands.json)
+ * 
+ * Each entry (translation unit) is crawled with its own search path, built
+ * like dirs in main() from its directory, its -iquote and -I flags, and
+ * CPATH; "x.h" is looked for in all of those, <x.h> (when system headers are
+ * followed) in the -I ones, CPATH and then the system index. With
+ * --conditional, each entry's -D and -U flags apply on top of the command
+ * line's.
+ * 
+ * The entries are crawled concurrently, sharing what they can: a name is
+ * resolved once per distinct search path, a file is scanned once per
+ * distinct set of macros, and the includes of a file are resolved once per
+ * (search path, macros) pair, so headers common to many entries are found
+ * and read once for the whole database. Dependencies are printed as the
+ * paths they resolve to, relative to the entry's directory when inside it.
+*/
+struct CompDb
+{
+  struct Entry {
+    std::string directory; // with a trailing '/'
+    std::string file;      // as written in the database
+    std::string object;
+    uint32_t search = 0;   // index in searches
+    uint32_t macroSet = 0; // index in macroSets
+  };
+  struct Search {
+    std::vector<std::string> quote; // for "x.h"
+    std::vector<std::string> angle; // for <x.h>
+  };
+  typedef std::shared_ptr<const std::vector<std::string>> Names;
+
+  ScanOptions opts; // the command line's
+  std::vector<Entry> entries;
+  std::vector<Search> searches;
+  std::vector<Macros> macroSets;
+  OnceMap<std::string> resolved; // search, name -> path ("" if missing)
+  OnceMap<Names> scanned;        // macros, file -> included names
+  OnceMap<Names> edges;          // search, macros, file -> included files
+  OnceMap<Facts> own;            // file -> its facts on its own
+  OnceMap<Facts> closed;         // search, file -> its facts with all it reaches
+  FileIds fileIds; // files are keyed by keyOfPath(), so every path to one is one key
+
+  explicit CompDb(const ScanOptions &opts) : opts(opts) {}
+
+  // a relative directory is taken from base
+  static std::string joinDir(const std::string &base, const std::string &dir) {
+    return dirName(dir[0] == '/' ? dir.c_str() : (base + dir).c_str());
+  }
+
+  /**
+   * @brief Reads the database, interning each entry's search path and macros
+   * 
+   * @param file The compile_commands.json file
+   * @param cpath The CPATH directories, with trailing '/'
+   * @return bool False if it could not be read
+  */
+  bool load(const char *file, const std::vector<std::string> &cpath) {
+    FILE *fd = fopen(file, "r");
+    if (fd == NULL) {
+      fprintf(stderr, "Error opening %s\n", file);
+      return false;
+    }
+    std::string text;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fd)) > 0)
+      text.append(buf, n);
+    fclose(fd);
+    JsonValue db;
+    if (!JsonParser::parse(text, &db) || db.type != JsonValue::ARRAY) {
+      fprintf(stderr, "Error parsing %s\n", file);
+      return false;
+    }
+    std::unordered_map<std::string, uint32_t> searchIds;
+    std::unordered_map<std::string, uint32_t> macroIds;
+    for (auto &item : db.items) {
+      const JsonValue *dir = item.get("directory");
+      const JsonValue *src = item.get("file");
+      const JsonValue *args = item.get("arguments");
+      const JsonValue *cmd = item.get("command");
+      const JsonValue *out = item.get("output");
+      if (!dir || dir->type != JsonValue::STRING || !src || src->type != JsonValue::STRING ||
+          !((args && args->type == JsonValue::ARRAY) || (cmd && cmd->type == JsonValue::STRING))) {
+        fprintf(stderr, "Skipping an entry of %s without directory, file and a command\n", file);
+        continue;
+      }
+      Entry e;
+      e.directory = dirName(dir->str.c_str());
+      e.file = src->str;
+      std::vector<std::string> words;
+      if (args && args->type == JsonValue::ARRAY) {
+        for (auto &a : args->items)
+          words.push_back(a.str);
+      } else {
+        words = splitCommand(cmd->str);
+      }
+      // the flags that matter; each takes its value joined or as the next word
+      Search search;
+      search.quote.push_back(e.directory);
+      Macros macros = opts.macros;
+      std::string object;
+      for (size_t i = 1; i < words.size(); i++) {
+        const std::string &w = words[i];
+        static const char *const flags[] = { "-iquote", "-I", "-D", "-U", "-o" };
+        for (const char *flag : flags) {
+          size_t len = strlen(flag);
+          if (w.compare(0, len, flag) != 0)
+            continue;
+          std::string value = w.substr(len);
+          if (value.empty() && i + 1 < words.size())
+            value = words[++i];
+          if (strcmp(flag, "-iquote") == 0) {
+            search.quote.push_back(joinDir(e.directory, value));
+          } else if (strcmp(flag, "-I") == 0) {
+            search.angle.push_back(joinDir(e.directory, value));
+          } else if (strcmp(flag, "-D") == 0) {
+            std::string::size_type eq = value.find('=');
+            if (eq == std::string::npos)
+              macros[value] = "1";
+            else
+              macros[value.substr(0, eq)] = value.substr(eq + 1);
+          } else if (strcmp(flag, "-U") == 0) {
+            macros[value] = NOT_DEFINED;
+          } else {
+            object = value;
+          }
+          break;
+        }
+      }
+      search.angle.insert(search.angle.end(), cpath.begin(), cpath.end());
+      search.quote.insert(search.quote.end(), search.angle.begin(), search.angle.end());
+      if (out && out->type == JsonValue::STRING)
+        object = out->str;
+      e.object = object.empty() ? parseFile(e.file.c_str()).first + ".o" : object;
+
+      // intern the search path and (with --conditional) the macros
+      std::string key;
+      for (auto &d : search.quote)
+        key += d + '\n';
+      key += '\n';
+      for (auto &d : search.angle)
+        key += d + '\n';
+      auto sins = searchIds.insert({ key, (uint32_t)searches.size() });
+      if (sins.second)
+        searches.push_back(search);
+      e.search = sins.first->second;
+      std::vector<std::string> defs;
+      if (opts.conditional)
+        for (auto &m : macros)
+          defs.push_back(m.first + "=" + m.second);
+      std::sort(defs.begin(), defs.end());
+      key.clear();
+      for (auto &d : defs)
+        key += d + '\n';
+      auto mins = macroIds.insert({ key, (uint32_t)macroSets.size() });
+      if (mins.second)
+        macroSets.push_back(macros);
+      e.macroSet = mins.first->second;
+      entries.push_back(e);
+    }
+    return true;
+  }
+
+  /**
+   * @brief Finds the file an include line names, on a search path
+   * 
+   * @param search The search path
+   * @param name The name, with <> around it for an angle include
+   * @return std::string The path ("" if not found), or for a system header
+   * "<" followed by its node in sysIndex
+  */
+  std::string locate(uint32_t search, const std::string &name) {
+    bool angle = name[0] == '<';
+    std::string bare = angle ? name.substr(1, name.size() - 2) : name;
+    for (auto &dir : angle ? searches[search].angle : searches[search].quote)
+      if (dirCache.contains(dir, bare))
+        return dir + bare;
+    long node = angle ? sysIndex.find(bare) : -1;
+    return node < 0 ? std::string() : "<" + std::to_string(node);
+  }
+
+  // as locate(), once per search path and name, reporting a missing "x.h"
+  std::string resolve(uint32_t search, const std::string &name) {
+    return resolved.get(std::to_string(search) + '\n' + name, [this, search, &name]() {
+      std::string path = locate(search, name);
+      if (path.empty() && name[0] != '<')
+        fprintf(stderr, "Error opening %s\n", name.c_str());
+      return path;
+    });
+  }
+
+  /**
+   * @brief Returns what including a file changes, for one search path
+   * 
+   * @param search The search path
+   * @param path The file, as resolve() returns it
+   * @return Facts Its facts with all it reaches, as from closeFacts()
+  */
+  Facts factsOf(uint32_t search, const std::string &path) {
+    if (path.empty())
+      return unknownFacts();
+    // a system header reaches the same files on any search path
+    auto closedKey = [this, search](const std::string &p) {
+      return p[0] == '<' ? p : std::to_string(search) + '\n' + fileIds.keyOfPath(p);
+    };
+    return closed.get(closedKey(path), [this, search, &path, &closedKey]() {
+      return closeFacts(path,
+                        [this](const std::string &p) {
+                          return own.get(p[0] == '<' ? p : fileIds.keyOfPath(p), [&p]() {
+                            return readFacts(p[0] == '<' ? std::string(sysIndex.path(atol(p.c_str() + 1))) : p);
+                          });
+                        },
+                        [this, search](const std::string &name) {
+                          return name[0] == '!' ? std::string() : locate(search, name);
+                        },
+                        [this, &closedKey](const std::string &p) {
+                          Facts f;
+                          closed.peek(closedKey(p), &f);
+                          return f;
+                        });
+    });
+  }
+
+  /**
+   * @brief Returns the paths a file includes, in order, for one search path
+   * and set of macros
+   * 
+   * @param search The search path
+   * @param macroSet The macros
+   * @param path The file
+   * @return Names The included files, as resolve() returns them, or for a
+   * file that was not found "?" followed by its name
+  */
+  Names includesOf(uint32_t search, uint32_t macroSet, const std::string &path) {
+    std::string id = fileIds.keyOfPath(path);
+    std::string key = std::to_string(search) + '\n' + std::to_string(macroSet) + '\n' + id;
+    return edges.get(key, [this, search, macroSet, &path, &id]() {
+      // with --conditional, guards (found on the search path) can change a scan
+      std::string skey = (opts.conditional ? std::to_string(search) : "") + '\n' +
+                         std::to_string(macroSet) + '\n' + id;
+      Names names = scanned.get(skey, [this, search, macroSet, &path]() {
+        auto list = std::make_shared<std::vector<std::string>>();
+        std::string guard;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+          fprintf(stderr, "Error opening %s\n", path.c_str());
+          return Names(list);
+        }
+        // the cache only holds lists made with the command line's macros
+        readIncludes(fd, path, path.c_str(), searches[search].quote, opts, macroSets[macroSet],
+                     depCache.enabled && !opts.conditional,
+                     [this, search](const std::string &name) {
+                       return factsOf(search, locate(search, name));
+                     }, list.get(), &guard);
+        return Names(list);
+      });
+      auto list = std::make_shared<std::vector<std::string>>();
+      for (auto &name : *names) {
+        std::string p = resolve(search, name);
+        list->push_back(p.empty() ? "?" + name : p);
+      }
+      return Names(list);
+    });
+  }
+
+  /**
+   * @brief Makes the dependency line of one entry, in the order
+   * printFrozen() would
+   * 
+   * @param e The entry
+   * @return std::string The line, with its newline
+  */
+  std::string line(const Entry &e) {
+    std::string out = e.object + ": " + e.file;
+    std::string root = e.file[0] == '/' ? e.file : e.directory + e.file;
+    // printed holds files, so a file reached by two paths is printed once;
+    // both tables come from an arena given back in one go on return
+    char buf[16384];
+    std::pmr::monotonic_buffer_resource arena(buf, sizeof(buf));
+    std::pmr::unordered_set<std::pmr::string> printed(&arena);
+    std::pmr::list<std::pmr::string> toProcess(&arena);
+    printed.emplace(fileIds.keyOfPath(root));
+    toProcess.emplace_back(root);
+    while (!toProcess.empty()) {
+      std::string path(toProcess.front());
+      toProcess.pop_front();
+      std::vector<std::string> deps;
+      if (path[0] == '<') {
+        for (uint32_t e : sysIndex.edgesOf(atol(path.c_str() + 1)))
+          deps.push_back("<" + std::to_string(e));
+      } else if (path[0] != '?') {
+        deps = *includesOf(e.search, e.macroSet, path);
+      }
+      for (auto &dep : deps) {
+        if (!printed.emplace(dep[0] == '<' || dep[0] == '?' ? dep : fileIds.keyOfPath(dep)).second)
+          continue;
+        if (dep[0] == '<')
+          out += std::string(" ") + sysIndex.path(atol(dep.c_str() + 1));
+        else if (dep[0] == '?')
+          out += " " + dep.substr(1);
+        else if (dep.compare(0, e.directory.size(), e.directory) == 0)
+          out += " " + dep.substr(e.directory.size());
+        else
+          out += " " + dep;
+        toProcess.emplace_back(dep);
+      }
+    }
+    return out + "\n";
+  }
+};
+
+// write content to path, unless path already holds exactly that content
+static bool writeIfChanged(const std::string &path, const std::string &content) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    struct stat st;
+    bool same = false;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size == content.size()) {
+      MappedFile mf;
+      same = mf.map(fd, st.st_size) &&
+             (content.empty() || memcmp(mf.data, content.data(), content.size()) == 0);
+    }
+    close(fd);
+    if (same)
+      return true;
+  }
+  // write a temporary file and rename it, so make never sees a partial file
+  std::string tmp = path + ".tmp" + std::to_string(getpid());
+  FILE *out = fopen(tmp.c_str(), "w");
+  if (out == NULL) {
+    fprintf(stderr, "Error writing %s\n", tmp.c_str());
+    return false;
+  }
+  fwrite(content.data(), 1, content.size(), out);
+  if (fclose(out) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+    fprintf(stderr, "Error writing %s\n", path.c_str());
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Writes the .d files of a share of the file arguments; thread i of n
+ * takes arguments i, i + n, i + 2n, ...
+ * 
+ * @param g The frozen graph
+ * @param files The file arguments
+ * @param i The index of this thread
+ * @param n The number of threads
+ * @return bool True if every .d file was written
+*/
+bool write_deps(const IdGraph *g, const std::vector<const char *> *files, int i, int n)
+{
+  bool ok = true;
+  Walk walk;
+  for (size_t f = i; f < files->size(); f += n) {
+    char *line = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&line, &len);
+    printFrozen(*g, (*files)[f], &walk, out);
+    fclose(out);
+    ok &= writeIfChanged(parseFile((*files)[f]).first + ".d", std::string(line, len));
+    free(line);
+  }
+  return ok;
+}
+
+// 5. with -MMD: write foo.d for each foo.c, with the pool's threads
+static bool writeDepFiles(const IdGraph &g, const std::vector<const char *> &files, ThreadPool &pool) {
+  int n = std::max<size_t>(pool.size(), 1);
+  std::vector<std::future<bool>> wfutures;
+  for (int i = 0; i < n; i++)
+    wfutures.push_back(pool.submit([&g, &files, i, n]() { return write_deps(&g, &files, i, n); }));
+  bool ok = true;
+  for (auto &f : wfutures)
+    ok &= f.get();
+  return ok;
+}
+
+/**
+ * @brief Server mode: keeps a DependencyGraph and its IdGraph resident between
+ * queries and uses inotify to find the files that changed, so each query
+ * rescans only those (see DependencyGraph::update())
+ * 
+ * A query is the client's working directory followed by its file arguments,
+ * each terminated by '\0'. The reply is a status byte, '0' or '1', followed by
+ * the dependency lines or an error message.
+*/
+struct Server
+{
+  int listenFd = -1;
+  int inotifyFd = -1;
+  ThreadPool *pool = nullptr;
+  DependencyGraph *graph = nullptr;
+  IdGraph frozen; // graph, as of the last query
+  std::string cwd;
+  // watch descriptor -> dir, under every spelling it was watched as (one
+  // directory reached as "../inc/" and "./../inc/" has one descriptor)
+  std::unordered_map<int, std::vector<std::string>> watchDirs;
+  std::unordered_set<std::string> watched;        // dirs being watched
+  std::set<std::string> changed;                  // paths changed since the last query
+
+  /**
+   * @brief Watches a directory for changes to its entries
+   * 
+   * @param dir The directory, with a trailing '/'
+   * @return void
+  */
+  void watch(const std::string &dir) {
+    if (!watched.insert(dir).second)
+      return;
+    int wd = inotify_add_watch(inotifyFd, dir.c_str(),
+                               IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE |
+                               IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd >= 0)
+      watchDirs[wd].push_back(dir);
+  }
+
+  /**
+   * @brief Handles one inotify event
+   * 
+   * @param ev The event
+   * @return void
+  */
+  void handle(const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+      // events were lost, so nothing can be trusted
+      graph->reset();
+      dirCache.listings.clear();
+      frozen = IdGraph();
+      changed.clear();
+      return;
+    }
+    auto wit = watchDirs.find(ev->wd);
+    if (wit == watchDirs.end() || ev->len == 0)
+      return;
+    // the path under each spelling, as origins knows only the one it was read as
+    for (auto &dir : wit->second)
+      changed.insert(dir + ev->name);
+  }
+
+  /**
+   * @brief Reads and handles all pending inotify events
+   * 
+   * @return void
+  */
+  void drainEvents() {
+    alignas(struct inotify_event) char buf[16384];
+    ssize_t len;
+    while ((len = read(inotifyFd, buf, sizeof(buf))) > 0) {
+      for (char *p = buf; p < buf + len; ) {
+        const struct inotify_event *ev = (const struct inotify_event *)p;
+        handle(ev);
+        p += sizeof(struct inotify_event) + ev->len;
+      }
+    }
+  }
+
+  /**
+   * @brief Answers one query
+   * 
+   * @param args The working directory followed by the file arguments
+   * @param out Where the reply goes
+   * @return bool True if the query was valid
+  */
+  bool answer(const std::vector<std::string> &args, FILE *out) {
+    if (args.empty() || args[0] != cwd) {
+      fprintf(out, "server is running in %s\n", cwd.c_str());
+      return false;
+    }
+    for (size_t i = 1; i < args.size(); i++) {
+      std::pair<std::string, std::string> pair = parseFile(args[i].c_str());
+      if (pair.second != "c" && pair.second != "y" && pair.second != "l") {
+        fprintf(out, "Illegal extension: %s - must be .c, .y or .l\n",
+                pair.second.c_str());
+        return false;
+      }
+    }
+    drainEvents();
+    std::vector<std::string> added; // foo.o keys new to the frozen graph
+    for (size_t i = 1; i < args.size(); i++) {
+      graph->addTarget(args[i].c_str());
+      std::string obj = parseFile(args[i].c_str()).first + ".o";
+      if (!frozen.ids.count(obj))
+        added.push_back(obj);
+    }
+    std::vector<std::string> keys =
+      graph->update(std::vector<std::string>(changed.begin(), changed.end()), *pool);
+    changed.clear();
+    if (crawlStats.enabled) {
+      crawlStats.report(stderr);
+      crawlStats.reset();
+    }
+    if (frozen.names.empty()) {
+      frozen.build(*graph, {});
+    } else {
+      keys.insert(keys.end(), added.begin(), added.end());
+      frozen.update(*graph, keys);
+    }
+    // watch every directory a file was read from
+    for (auto &p : graph->origins.theTable) {
+      std::string::size_type slash = p.first.rfind('/');
+      if (slash != std::string::npos)
+        watch(std::string(p.first, 0, slash + 1));
+    }
+    Walk walk;
+    for (size_t i = 1; i < args.size(); i++)
+      printFrozen(frozen, args[i].c_str(), &walk, out);
+    return true;
+  }
+
+  /**
+   * @brief Accepts and answers queries until killed
+   * 
+   * @param socketPath The Unix socket to listen on
+   * @return int Only returns on error
+  */
+  int run(const char *socketPath) {
+    char buf[PATH_MAX];
+    if (getcwd(buf, sizeof(buf)) == NULL) {
+      perror("getcwd");
+      return -1;
+    }
+    cwd = buf;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path too long: %s\n", socketPath);
+      return -1;
+    }
+    strcpy(addr.sun_path, socketPath);
+    unlink(socketPath);
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenFd, 64) < 0) {
+      perror(socketPath);
+      return -1;
+    }
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd < 0) {
+      perror("inotify_init1");
+      return -1;
+    }
+    graph->trackOrigins = true;
+    for (auto &dir : graph->dirs)
+      watch(dir);
+
+    for (;;) {
+      struct pollfd fds[2] = { { listenFd, POLLIN, 0 }, { inotifyFd, POLLIN, 0 } };
+      if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        perror("poll");
+        return -1;
+      }
+      if (fds[1].revents & POLLIN)
+        drainEvents();
+      if (!(fds[0].revents & POLLIN))
+        continue;
+      int conn = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+      if (conn < 0)
+        continue;
+      // read the whole query; the client shuts down its side when done
+      std::string query;
+      ssize_t len;
+      while ((len = read(conn, buf, sizeof(buf))) > 0)
+        query.append(buf, len);
+      std::vector<std::string> args;
+      std::string::size_type last = 0, next;
+      while ((next = query.find('\0', last)) != std::string::npos) {
+        args.push_back(query.substr(last, next - last));
+        last = next + 1;
+      }
+      char *reply = NULL;
+      size_t replyLen = 0;
+      FILE *out = open_memstream(&reply, &replyLen);
+      fputc('0', out);
+      bool ok = answer(args, out);
+      fclose(out);
+      if (!ok)
+        reply[0] = '1';
+      for (size_t done = 0; done < replyLen; ) {
+        ssize_t n = send(conn, reply + done, replyLen - done, MSG_NOSIGNAL);
+        if (n <= 0)
+          break;
+        done += n;
+      }
+      free(reply);
+      close(conn);
+    }
+  }
+};
+
+// client mode: send the file arguments to a server and print its reply
+static int runClient(const char *socketPath, int argc, char *argv[], int start) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", socketPath);
+    return -1;
+  }
+  strcpy(addr.sun_path, socketPath);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror(socketPath);
+    return -1;
+  }
+  char buf[PATH_MAX];
+  if (getcwd(buf, sizeof(buf)) == NULL) {
+    perror("getcwd");
+    return -1;
+  }
+  std::string query = buf;
+  query += '\0';
+  for (int i = start; i < argc; i++) {
+    query += argv[i];
+    query += '\0';
+  }
+  for (size_t done = 0; done < query.size(); ) {
+    ssize_t n = send(fd, query.data() + done, query.size() - done, MSG_NOSIGNAL);
+    if (n <= 0) {
+      perror(socketPath);
+      return -1;
+    }
+    done += n;
+  }
+  shutdown(fd, SHUT_WR);
+  std::string reply;
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0)
+    reply.append(buf, len);
+  close(fd);
+  if (reply.empty()) {
+    fprintf(stderr, "No reply from %s\n", socketPath);
+    return -1;
+  }
+  FILE *out = reply[0] == '0' ? stdout : stderr;
+  fwrite(reply.data() + 1, 1, reply.size() - 1, out);
+  return reply[0] == '0' ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+  // 1. look up CPATH in environment
+  char *cpath = getenv("CPATH");
+
+  // server or client mode?
+  const char *serverSocket = NULL;
+  const char *clientSocket = NULL;
+  int i = 1;
+  if (i < argc && strncmp(argv[i], "--server=", 9) == 0)
+    serverSocket = argv[i++] + 9;
+  else if (i < argc && strncmp(argv[i], "--client=", 9) == 0)
+    clientSocket = argv[i++] + 9;
+  int first = i;
+
+  // determine the number of -Idir (and -MMD, --conditional, --grammar, -D, -U, -R) arguments
+  bool mmd = false;
+  ScanOptions opts;
+  std::vector<const char *> changed;
+  const char *compdbFile = NULL;
+  for (; i < argc; i++) {
+    if (strcmp(argv[i], "-MMD") == 0) {
+      mmd = true;
+    } else if (strncmp(argv[i], "--compdb=", 9) == 0) {
+      compdbFile = argv[i] + 9;
+    } else if (strncmp(argv[i], "-R", 2) == 0) {
+      changed.push_back(argv[i] + 2);
+    } else if (!opts.parse(argv[i]) && strncmp(argv[i], "-I", 2) != 0) {
+      break;
+    }
+  }
+  int start = i;
+
+  if (clientSocket) {
+    if (start != first) {
+      fprintf(stderr, "the client takes only file arguments\n");
+      return -1;
+    }
+    return runClient(clientSocket, argc, argv, start);
+  }
+  if (serverSocket && (start != argc || mmd || !changed.empty())) {
+    fprintf(stderr, "the server takes no -MMD, -R or file arguments\n");
+    return -1;
+  }
+  if (mmd && !changed.empty()) {
+    fprintf(stderr, "-MMD and -R cannot be used together\n");
+    return -1;
+  }
+  if (compdbFile && (serverSocket || mmd || !changed.empty() || start != argc)) {
+    fprintf(stderr, "--compdb takes no --server, -MMD, -R or file arguments\n");
+    return -1;
+  }
+
+  // 2. start assembling dirs vector (of the graph that holds the crawl)
+  DependencyGraph graph;
+  graph.opts = opts;
+  std::vector<std::string> &dirs = graph.dirs;
+  dirs.push_back( dirName("./") ); // always search current directory first
+  for (i = first; i < start; i++) {
+    if (strncmp(argv[i], "-I", 2) == 0)
+      dirs.push_back( dirName(argv[i] + 2 /* skip -I */) );
+  }
+  if (cpath != NULL) {
+    std::string str( cpath );
+    std::string::size_type last = 0;
+    std::string::size_type next = 0;
+    while((next = str.find(":", last)) != std::string::npos) {
+      dirs.push_back( dirName(str.substr(last, next-last).c_str()) );
+      last = next + 1;
+    }
+    dirs.push_back( dirName(str.substr(last).c_str()) );
+  }
+  // 2. finished assembling dirs vector
+
+  // 3. for each file argument ...
+  for (i = start; i < argc; i++) {
+    if (!graph.addTarget(argv[i]))
+      return -1;
+  }
+
+  // 3.5. Get the number of threads to use
+  ThreadPool::Options poolOptions = ThreadPool::Options::fromEnv(CRAWLER_THREADS_DEFAULT);
+  char *prefetchEnv = getenv("CRAWLER_PREFETCH");
+  if (prefetchEnv) {
+    try {
+      graph.prefetcher.numThreads = std::max(0, std::stoi(prefetchEnv));
+    } catch (...) {
+      graph.prefetcher.numThreads = 0;
+    }
+  }
+  char *engineEnv = getenv("CRAWLER_ENGINE");
+  if (engineEnv && strcmp(engineEnv, "coro") == 0) {
+#ifdef CRAWLER_COROUTINES
+    char *ioEnv = getenv("CRAWLER_CORO_IO");
+    coroIoThreads = ioEnv && atoi(ioEnv) > 0 ? atoi(ioEnv) : 64;
+    // one executor thread per core, unless CRAWLER_THREADS says otherwise
+    if (!getenv("CRAWLER_THREADS"))
+      poolOptions.threads = std::max(1u, std::thread::hardware_concurrency());
+    poolOptions.threads = std::max(poolOptions.threads, 1);
+#else
+    fprintf(stderr, "CRAWLER_ENGINE=coro needs a C++20 build (make coro) - using threads\n");
+#endif
+  } else if (engineEnv && *engineEnv && strcmp(engineEnv, "threads") != 0) {
+    fprintf(stderr, "Unknown CRAWLER_ENGINE %s - must be threads or coro\n", engineEnv);
+  }
+  char *statsEnv = getenv("CRAWLER_STATS");
+  crawlStats.enabled = statsEnv && *statsEnv && strcmp(statsEnv, "0") != 0;
+
+  // 3.52. Load the system header index, building it if needed
+  char *sysIndexFile = getenv("CRAWLER_SYSINDEX");
+  if (sysIndexFile && *sysIndexFile) {
+    char *sysDirs = getenv("CRAWLER_SYSDIRS");
+    std::string str( sysDirs ? sysDirs : SysIndex::compilerDirs() );
+    std::string::size_type last = 0;
+    std::string::size_type next = 0;
+    while((next = str.find(":", last)) != std::string::npos) {
+      sysIndex.roots.push_back( dirName(str.substr(last, next-last).c_str()) );
+      last = next + 1;
+    }
+    sysIndex.roots.push_back( dirName(str.substr(last).c_str()) );
+    if (!sysIndex.load(sysIndexFile)) {
+      fprintf(stderr, "Error loading system index %s\n", sysIndexFile);
+      return -1;
+    }
+  }
+
+  // 3.6. Create the threads, which are kept for everything below
+  ThreadPool pool(poolOptions);
+
+  if (serverSocket) {
+    Server server;
+    server.pool = &pool;
+    server.graph = &graph;
+    return server.run(serverSocket);
+  }
+
+  // 3.55. Load the on-disk cache, if one is wanted
+  char *cacheFile = getenv("CRAWLER_CACHE");
+  if (cacheFile && *cacheFile) {
+    if (opts.conditional || sysIndex.enabled || opts.grammars) {
+      // lists depend on the macros, on whether <...> lines are kept and on
+      // --grammar, so they are part of the cache's identity
+      std::vector<std::string> defs;
+      for (auto &m : opts.macros)
+        defs.push_back(m.first + "=" + m.second);
+      std::sort(defs.begin(), defs.end());
+      std::string all = opts.conditional ? "conditional" : "";
+      for (auto &d : defs)
+        all += "\n" + d;
+      if (sysIndex.enabled)
+        all += "\nsystem";
+      if (opts.grammars)
+        all += "\ngrammar";
+      depCache.config = hashBytes(all.data(), all.size());
+    }
+    depCache.load(cacheFile);
+  }
+
+  // 3.6.5. With a compilation database: crawl and print each entry instead
+  if (compdbFile) {
+    CompDb db(opts);
+    if (!db.load(compdbFile, std::vector<std::string>(dirs.begin() + 1, dirs.end())))
+      return -1;
+    std::vector<std::future<std::string>> lines;
+    for (auto &e : db.entries)
+      lines.push_back(pool.submit([&db, &e]() { return db.line(e); }));
+    for (auto &l : lines)
+      fputs(l.get().c_str(), stdout);
+    if (cacheFile && *cacheFile)
+      depCache.save(cacheFile);
+    sysIndex.refresh(sysIndexFile);
+    return 0;
+  }
+
+  // 3.7. Run do_work on the threads and wait for them to finish
+  // 4. for each file on the workQ => in do_work
+  // (or with CRAWLER_PROCS, in worker processes)
+  char *procsEnv = getenv("CRAWLER_PROCS");
+  if (procsEnv && atoi(procsEnv) > 0) {
+    char *shmEnv = getenv("CRAWLER_SHM_MB");
+    SharedCrawl shared(graph);
+    if (!shared.create(shmEnv && atoi(shmEnv) > 0 ? atoi(shmEnv) : 1024)) {
+      perror("Error making the shared segment");
+      return -1;
+    }
+    if (!shared.run(atoi(procsEnv)))
+      return -1;
+  } else {
+    graph.crawl(pool);
+  }
+
+  // 4.5. Save the on-disk cache, and the system index if it went stale
+  if (cacheFile && *cacheFile)
+    depCache.save(cacheFile);
+  sysIndex.refresh(sysIndexFile);
+  if (crawlStats.enabled)
+    crawlStats.report(stderr);
+
+  // 4.6. Freeze theTable into a compact graph, which everything below reads
+  std::vector<const char *> files(argv + start, argv + argc);
+  IdGraph frozen;
+  frozen.build(graph, files);
+  if (!changed.empty())
+    frozen.buildReverse();
+  graph.theTable.release();
+
+  // 4.7. Analyse the graph, while it is printed, if a report is wanted
+  char *reportFile = getenv("CRAWLER_REPORT");
+  std::future<bool> report;
+  if (reportFile && *reportFile) {
+    char *topEnv = getenv("CRAWLER_REPORT_TOP");
+    size_t top = topEnv && atoi(topEnv) > 0 ? atoi(topEnv) : 10;
+    report = pool.submit([&frozen, reportFile, top]() {
+      FILE *fd = fopen(reportFile, "w");
+      if (fd == NULL) {
+        fprintf(stderr, "Error writing %s\n", reportFile);
+        return false;
+      }
+      writeReport(frozen, fd, top);
+      return fclose(fd) == 0;
+    });
+  }
+
+  // 5. for each file argument (or with -R, each changed file)
+  bool ok = true;
+  if (!changed.empty()) {
+    for (auto c : changed)
+      ok &= printDependents(frozen, graph.dirs, c, pool, stdout);
+  } else if (mmd) {
+    ok = writeDepFiles(frozen, files, pool);
+  } else {
+    Walk walk;
+    for (i = start; i < argc; i++) {
+      printFrozen(frozen, argv[i], &walk, stdout);
+    }
   }
+  if (report.valid())
+    ok &= report.get();
 
-  return 0;
+  return ok ? 0 : -1;
 }
@@ -0,0 +1,134 @@
+/*
+ * usage: ./gengraph fanout|chain|diamond|cycle nfiles dir
+ *
+ * writes a synthetic tree of nfiles .c and .h files into dir (which must
+ * exist) for benchmarking dependencyDiscoverer; the shapes are
+ *
+ *   fanout  - a wide, shallow graph: a tenth of the files are sources, each
+ *             including 10 headers; a tenth of the headers include 8 leaf
+ *             headers each
+ *   chain   - 4 sources including the head of one long chain of headers,
+ *             h_0 -> h_1 -> ... -> h_n
+ *   diamond - headers in diamonds of 4 (top includes left and right, both
+ *             include bottom), each bottom including the next diamond's top
+ *             in runs of 16 diamonds; sources include 2 diamond tops
+ *   cycle   - headers in rings of 8 (each including the next), each ring
+ *             also including a ring in the same group of 8 rings; sources
+ *             include 2 headers
+ *
+ * the same arguments always produce the same tree
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "rng.h"
+
+static std::string dir;
+
+static std::string header(long i) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "h_%07ld.h", i);
+  return buf;
+}
+
+// write one file that includes the given headers
+static bool writeFile(const std::string &name, const std::vector<long> &includes) {
+  std::string path = dir + "/" + name;
+  FILE *fd = fopen(path.c_str(), "w");
+  if (fd == NULL) {
+    perror(path.c_str());
+    return false;
+  }
+  fprintf(fd, "/* %s */\n#include <stdio.h>\n", name.c_str());
+  for (long h : includes)
+    fprintf(fd, "#include \"%s\"\n", header(h).c_str());
+  fprintf(fd, "int x_%s;\n", name.substr(0, name.size() - 2).c_str());
+  return fclose(fd) == 0;
+}
+
+static bool writeSource(long i, const std::vector<long> &includes) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "s_%07ld.c", i);
+  return writeFile(buf, includes);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 4 || atol(argv[2]) < 2) {
+    fprintf(stderr, "usage: %s fanout|chain|diamond|cycle nfiles dir\n", argv[0]);
+    return -1;
+  }
+  std::string shape = argv[1];
+  long n = atol(argv[2]);
+  dir = argv[3];
+  Rng rng;
+  bool ok = true;
+
+  if (shape == "fanout") {
+    long sources = n / 10 > 0 ? n / 10 : 1;
+    long headers = n - sources;
+    long mids = headers / 10 > 0 ? headers / 10 : 1;
+    for (long h = 0; h < headers && ok; h++) {
+      std::vector<long> inc;
+      if (h < mids && headers > mids)
+        for (int k = 0; k < 8; k++)
+          inc.push_back(mids + rng.below(headers - mids));
+      ok = writeFile(header(h), inc);
+    }
+    for (long s = 0; s < sources && ok; s++) {
+      std::vector<long> inc;
+      for (int k = 0; k < 10; k++)
+        inc.push_back(rng.below(headers));
+      ok = writeSource(s, inc);
+    }
+  } else if (shape == "chain") {
+    long sources = 4;
+    long headers = n > sources ? n - sources : 1;
+    for (long h = 0; h < headers && ok; h++) {
+      std::vector<long> inc;
+      if (h + 1 < headers)
+        inc.push_back(h + 1);
+      ok = writeFile(header(h), inc);
+    }
+    for (long s = 0; s < sources && ok; s++)
+      ok = writeSource(s, { 0 });
+  } else if (shape == "diamond") {
+    long sources = n / 10 > 0 ? n / 10 : 1;
+    long diamonds = (n - sources) / 4 > 0 ? (n - sources) / 4 : 1;
+    for (long d = 0; d < diamonds && ok; d++) {
+      long top = 4 * d, left = top + 1, right = top + 2, bottom = top + 3;
+      std::vector<long> next;
+      if ((d + 1) % 16 != 0 && d + 1 < diamonds)
+        next.push_back(4 * (d + 1));
+      ok = writeFile(header(top), { left, right }) &&
+           writeFile(header(left), { bottom }) &&
+           writeFile(header(right), { bottom }) &&
+           writeFile(header(bottom), next);
+    }
+    for (long s = 0; s < sources && ok; s++)
+      ok = writeSource(s, { 4 * rng.below(diamonds), 4 * rng.below(diamonds) });
+  } else if (shape == "cycle") {
+    long sources = n / 10 > 0 ? n / 10 : 1;
+    long rings = (n - sources) / 8 > 0 ? (n - sources) / 8 : 1;
+    for (long r = 0; r < rings && ok; r++) {
+      long group = r - r % 8;
+      long other = group + rng.below(8);
+      for (long k = 0; k < 8 && ok; k++) {
+        std::vector<long> inc = { 8 * r + (k + 1) % 8 };
+        if (k == 0 && other < rings && other != r)
+          inc.push_back(8 * other + rng.below(8));
+        ok = writeFile(header(8 * r + k), inc);
+      }
+    }
+    for (long s = 0; s < sources && ok; s++)
+      ok = writeSource(s, { rng.below(8 * rings), rng.below(8 * rings) });
+  } else {
+    fprintf(stderr, "Unknown shape: %s\n", shape.c_str());
+    return -1;
+  }
+  return ok ? 0 : -1;
+}
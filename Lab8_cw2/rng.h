@@ -0,0 +1,33 @@
+/*
+ * rng.h - the small deterministic random number generator shared by
+ * gengraph.cpp and stress.cpp, so that both draw the same sequence from the
+ * same seed
+ */
+
+#ifndef RNG_H
+#define RNG_H
+
+/**
+ * @brief A small deterministic xorshift random number generator
+*/
+struct Rng
+{
+  unsigned long long x;
+
+  explicit Rng(unsigned long long seed = 0) : x(88172645463325252ULL ^ (seed * 0x9e3779b97f4a7c15ULL)) {}
+
+  /**
+   * @brief Returns a number in [0, n)
+   *
+   * @param n The bound, which must be positive
+   * @return long The number
+  */
+  long below(long n) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return (long)(x % (unsigned long long)n);
+  }
+};
+
+#endif
@@ -0,0 +1,506 @@
+/*
+ * usage: ./stress queue|stable|mutex|map [-tthreads,...] [-nops] [-wpercent] [-kkeys] [-f]
+ *
+ * hammers a ConcQueue or a ConcMap (see concurrent.h) from each number of
+ * threads in turn, printing the throughput and latency percentiles of its
+ * operations, then checks that what every run returned is linearizable
+ *
+ *   queue  - each operation is a push_back() of a new name (-w percent of
+ *            them, default 50), which interns it under the queue's NameTable
+ *            lock, or else a get_next() and, if it returned a name, done();
+ *            the names left are drained afterwards
+ *   stable - the same, but pushing with push_stable(), as the crawler does
+ *            with its table's keys, so no push takes a lock
+ *   mutex  - the same against MutexQueue, the list under one mutex that
+ *            ConcQueue replaced, as the baseline for both
+ *   map   - each operation is on one of -k keys (default 10000), chosen at
+ *           random: an insert() or a get() (-w percent, default 20, half
+ *           each), or else a find()
+ *
+ *   -t  the thread counts to try, separated by ',' (default 1,2,4,8,16,32,64)
+ *   -n  the operations of each run, shared by its threads (default 200000)
+ *   -f  count FIFO order inversions as failures (see checkQueue())
+ *
+ * every operation's call and return are timed on one monotonic clock, and
+ * the histories are checked against a sequential queue or map afterwards,
+ * so the checks cost the runs nothing (see checkQueue() and checkMap())
+ *
+ * the exit status is non-zero if any run failed its check; "make stress"
+ * builds it, and "make stress-tsan" builds it with ThreadSanitizer, which
+ * also checks the containers for data races
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "concurrent.h"
+#include "rng.h"
+
+// one operation of a history
+struct Op
+{
+  enum Kind { PUSH, POP, EMPTY, INSERT, GET, FIND };
+  uint64_t inv;   // when it was called
+  uint64_t res;   // when it returned
+  uint32_t arg;   // the name pushed or popped, or the key
+  uint8_t kind;
+  uint8_t result; // what insert() or find() said
+};
+
+/**
+ * @brief What a check found wrong
+*/
+struct Verdict
+{
+  unsigned long violations = 0; // each one enough to not be linearizable
+  unsigned long inversions = 0; // queue only: names taken out of FIFO order
+  std::string first;            // the first violation, described
+
+  void fail(const std::string &what) {
+    if (violations++ == 0)
+      first = what;
+  }
+};
+
+/**
+ * @brief Starts n threads on body(t), all released at once, and waits for
+ * them
+ *
+ * @param n The number of threads
+ * @param body Called with each thread's number
+ * @return uint64_t The wall time from the release to the last thread ending
+*/
+template <typename Body>
+static uint64_t runThreads(int n, Body body) {
+  std::atomic<int> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n; t++) {
+    threads.emplace_back([&, t]() {
+      ready++;
+      while (!go.load(std::memory_order_acquire))
+        std::this_thread::yield();
+      body(t);
+    });
+  }
+  while (ready.load() < n)
+    std::this_thread::yield();
+  uint64_t t0 = nowNs();
+  go = true;
+  for (auto &th : threads)
+    th.join();
+  return nowNs() - t0;
+}
+
+/**
+ * @brief The queue ConcQueue replaced, kept as the baseline it is measured
+ * against: a list of strings under one mutex
+*/
+struct MutexQueue
+{
+  std::list<std::string> queue;
+  std::mutex m;
+
+  void push_back(std::string s) {
+    auto lock = crawlStats.lock(m, crawlStats.queueLock);
+    queue.push_back(std::move(s));
+  }
+
+  // "" if the queue is empty, without waiting for work still being done
+  std::string get_next() {
+    auto lock = crawlStats.lock(m, crawlStats.queueLock);
+    if (queue.empty())
+      return "";
+    std::string s = std::move(queue.front());
+    queue.pop_front();
+    return s;
+  }
+
+  void done() {}
+};
+
+/**
+ * @brief One run against a queue
+ *
+ * @param q The queue, empty
+ * @param push Pushes a name to q, given the string that holds it
+ * @param n The number of threads
+ * @param ops The operations, shared by the threads
+ * @param writes The percentage of them that are pushes
+ * @param history Filled with each thread's operations, then the drain's
+ * @return uint64_t The wall time of the timed part
+*/
+template <typename Queue, typename Push>
+static uint64_t runQueue(Queue &q, Push push, int n, long ops, int writes,
+                         std::vector<std::vector<Op>> *history) {
+  long per = std::max(1L, ops / n);
+  // names "v<i>", each pushed once; they outlive the queue, so push may hand
+  // it the strings themselves
+  std::vector<std::string> names(per * n);
+  for (size_t i = 0; i < names.size(); i++)
+    names[i] = "v" + std::to_string(i);
+  history->assign(n + 1, {});
+  for (auto &h : *history)
+    h.reserve(per);
+  uint64_t wall = runThreads(n, [&](int t) {
+    Rng rng(t);
+    std::vector<Op> &h = (*history)[t];
+    uint32_t next = t * per;
+    for (long i = 0; i < per; i++) {
+      Op op;
+      if (rng.below(100) < writes) {
+        op.kind = Op::PUSH;
+        op.arg = next;
+        op.inv = nowNs();
+        push(names[next++]);
+        op.res = nowNs();
+      } else {
+        op.inv = nowNs();
+        std::string s = q.get_next();
+        op.res = nowNs();
+        op.kind = s.empty() ? Op::EMPTY : Op::POP;
+        op.arg = s.empty() ? 0 : strtoul(s.c_str() + 1, NULL, 10);
+        if (!s.empty())
+          q.done();
+      }
+      op.result = 0;
+      h.push_back(op);
+    }
+  });
+  // take what is left, so every name pushed should have been taken once
+  std::vector<Op> &h = (*history)[n];
+  for (;;) {
+    Op op;
+    op.inv = nowNs();
+    std::string s = q.get_next();
+    op.res = nowNs();
+    if (s.empty())
+      break;
+    q.done();
+    op.kind = Op::POP;
+    op.arg = strtoul(s.c_str() + 1, NULL, 10);
+    op.result = 0;
+    h.push_back(op);
+  }
+  return wall;
+}
+
+/**
+ * @brief One run against the queue that mode names
+ *
+ * @param mode "queue", whose push_back() interns each name, "stable", which
+ * pushes the names with push_stable(), or "mutex", a MutexQueue
+ * @param n The number of threads
+ * @param ops The operations, shared by the threads
+ * @param writes The percentage of them that are pushes
+ * @param history Filled with each thread's operations, then the drain's
+ * @return uint64_t The wall time of the timed part
+*/
+static uint64_t runQueue(const std::string &mode, int n, long ops, int writes,
+                         std::vector<std::vector<Op>> *history) {
+  if (mode == "mutex") {
+    MutexQueue q;
+    return runQueue(q, [&q](const std::string &s) { q.push_back(s); }, n, ops, writes, history);
+  }
+  ConcQueue q;
+  if (mode == "stable")
+    return runQueue(q, [&q](const std::string &s) { q.push_stable(s); }, n, ops, writes, history);
+  return runQueue(q, [&q](const std::string &s) { q.push_back(s); }, n, ops, writes, history);
+}
+
+/**
+ * @brief One run against a ConcMap
+ *
+ * @param n The number of threads
+ * @param ops The operations, shared by the threads
+ * @param writes The percentage of them that are insert() or get()
+ * @param keys The number of keys
+ * @param history Filled with each thread's operations
+ * @return uint64_t The wall time
+*/
+static uint64_t runMap(int n, long ops, int writes, long keys,
+                       std::vector<std::vector<Op>> *history) {
+  long per = std::max(1L, ops / n);
+  std::vector<std::string> names(keys);
+  for (long k = 0; k < keys; k++)
+    names[k] = "k" + std::to_string(k);
+  ConcMap m;
+  history->assign(n, {});
+  for (auto &h : *history)
+    h.reserve(per);
+  return runThreads(n, [&](int t) {
+    Rng rng(t);
+    std::vector<Op> &h = (*history)[t];
+    for (long i = 0; i < per; i++) {
+      Op op;
+      long r = rng.below(200);
+      op.arg = rng.below(keys);
+      op.result = 0;
+      std::string s = names[op.arg];
+      if (r < writes) {
+        op.kind = Op::INSERT;
+        op.inv = nowNs();
+        op.result = m.insert({ std::move(s), DepList() }).second;
+        op.res = nowNs();
+      } else if (r < 2 * writes) {
+        op.kind = Op::GET;
+        op.inv = nowNs();
+        m.get(std::move(s));
+        op.res = nowNs();
+      } else {
+        op.kind = Op::FIND;
+        op.inv = nowNs();
+        op.result = m.find(std::move(s)) != m.end();
+        op.res = nowNs();
+      }
+      h.push_back(op);
+    }
+  });
+}
+
+/**
+ * @brief Checks a queue history, in which every name is pushed at most once
+ *
+ * With distinct names, a history is a linearizable FIFO queue exactly when
+ * none of these happen (Henzinger et al., "Aspect-oriented linearizability
+ * proofs", 2013):
+ * - a name is taken that was never pushed, or taken twice, or taken before
+ *   its push was called; or a pushed name is never taken
+ * - get_next() says there is no work while some name was pushed before it
+ *   was called and not taken until after it returned
+ * - x is pushed before y is, and y is taken before x is (an inversion)
+ * Each is found with a sort and a sweep. ConcQueue puts names in an overflow
+ * list when its ring is full and takes from the ring first, so it keeps FIFO
+ * order only while the ring has room; the crawl needs none, so inversions are
+ * only counted, unless strict.
+ *
+ * @param history The operations
+ * @param strict Whether inversions are violations
+ * @return Verdict What was found
+*/
+static Verdict checkQueue(const std::vector<std::vector<Op>> &history, bool strict) {
+  Verdict v;
+  struct Name {
+    const Op *push = nullptr;
+    const Op *pop = nullptr;
+  };
+  std::unordered_map<uint32_t, Name> names;
+  std::vector<const Op *> empties;
+  for (auto &h : history) {
+    for (auto &op : h) {
+      if (op.kind == Op::PUSH) {
+        names[op.arg].push = &op;
+      } else if (op.kind == Op::POP) {
+        Name &nm = names[op.arg];
+        if (nm.pop)
+          v.fail("v" + std::to_string(op.arg) + " was taken twice");
+        nm.pop = &op;
+      } else {
+        empties.push_back(&op);
+      }
+    }
+  }
+  std::vector<const Name *> taken;
+  for (auto &p : names) {
+    const Name &nm = p.second;
+    std::string name = "v" + std::to_string(p.first);
+    if (!nm.push)
+      v.fail(name + " was taken but never pushed");
+    else if (!nm.pop)
+      v.fail(name + " was pushed but never taken");
+    else if (nm.pop->res < nm.push->inv)
+      v.fail(name + " was taken before it was pushed");
+    else
+      taken.push_back(&nm);
+  }
+  // 1. no work, while some name was in the queue throughout
+  std::vector<const Name *> byPushRes(taken);
+  std::sort(byPushRes.begin(), byPushRes.end(),
+            [](const Name *a, const Name *b) { return a->push->res < b->push->res; });
+  std::sort(empties.begin(), empties.end(),
+            [](const Op *a, const Op *b) { return a->inv < b->inv; });
+  size_t k = 0;
+  const Name *latest = nullptr; // of those pushed so far, the one taken last
+  for (const Op *e : empties) {
+    for (; k < byPushRes.size() && byPushRes[k]->push->res < e->inv; k++)
+      if (!latest || byPushRes[k]->pop->inv > latest->pop->inv)
+        latest = byPushRes[k];
+    if (latest && latest->pop->inv > e->res)
+      v.fail("get_next() found no work while a name was queued");
+  }
+  // 2. inversions: for each y, the x pushed before it that was taken last
+  std::vector<const Name *> byPushInv(taken);
+  std::sort(byPushInv.begin(), byPushInv.end(),
+            [](const Name *a, const Name *b) { return a->push->inv < b->push->inv; });
+  k = 0;
+  latest = nullptr;
+  for (const Name *y : byPushInv) {
+    for (; k < byPushRes.size() && byPushRes[k]->push->res < y->push->inv; k++)
+      if (!latest || byPushRes[k]->pop->inv > latest->pop->inv)
+        latest = byPushRes[k];
+    if (latest && latest->pop->inv > y->pop->res) {
+      v.inversions++;
+      if (strict)
+        v.fail("a name was taken before one pushed ahead of it");
+    }
+  }
+  return v;
+}
+
+/**
+ * @brief Checks a map history
+ *
+ * Keys are independent, and a key only ever goes from absent to present, so
+ * each key's history is linearizable exactly when some moment T in the call
+ * of the operation that added it (the insert() that returned true, or else a
+ * get()) comes after every call that saw it absent (a find() that failed) and
+ * before every return that saw it present (a failed insert(), a find() that
+ * succeeded, or any other get()).
+ *
+ * @param history The operations
+ * @return Verdict What was found
+*/
+static Verdict checkMap(const std::vector<std::vector<Op>> &history) {
+  Verdict v;
+  struct Key {
+    int inserted = 0;             // insert()s that returned true
+    uint64_t addInv = UINT64_MAX; // earliest call that may have added it
+    uint64_t addRes = UINT64_MAX; // the return of the insert() that did
+    uint64_t absentInv = 0;       // latest call to see it absent
+    uint64_t presentRes = UINT64_MAX; // earliest return to see it present
+    bool present = false;         // some operation saw it, or added it
+  };
+  std::unordered_map<uint32_t, Key> keys;
+  for (auto &h : history) {
+    for (auto &op : h) {
+      Key &k = keys[op.arg];
+      if (op.kind == Op::INSERT && op.result) {
+        k.inserted++;
+        k.addInv = op.inv;
+        k.addRes = op.res;
+        k.present = true;
+        continue;
+      }
+      if (op.kind == Op::FIND && !op.result) {
+        k.absentInv = std::max(k.absentInv, op.inv);
+        continue;
+      }
+      k.present = true;
+      k.presentRes = std::min(k.presentRes, op.res);
+      if (op.kind == Op::GET && k.addRes == UINT64_MAX)
+        k.addInv = std::min(k.addInv, op.inv);
+    }
+  }
+  for (auto &p : keys) {
+    const Key &k = p.second;
+    std::string name = "k" + std::to_string(p.first);
+    if (k.inserted > 1) {
+      v.fail(name + " was inserted " + std::to_string(k.inserted) + " times");
+      continue;
+    }
+    if (!k.present)
+      continue; // never there, which every find() saw
+    if (k.addInv == UINT64_MAX) {
+      v.fail(name + " was found but never added");
+      continue;
+    }
+    uint64_t lo = std::max(k.addInv, k.absentInv);
+    uint64_t hi = std::min(k.addRes, k.presentRes);
+    if (lo > hi)
+      v.fail(name + " was seen present and absent out of order");
+  }
+  return v;
+}
+
+// parse "1,2,4" into numbers
+static std::vector<int> parseList(const char *s) {
+  std::vector<int> list;
+  for (const char *p = s; *p; ) {
+    char *end;
+    long n = strtol(p, &end, 10);
+    if (end == p)
+      break;
+    if (n > 0)
+      list.push_back(n);
+    p = *end == ',' ? end + 1 : end;
+    if (*end != ',')
+      break;
+  }
+  return list;
+}
+
+int main(int argc, char *argv[]) {
+  std::string kind = argc < 2 ? "" : argv[1];
+  if (kind != "queue" && kind != "stable" && kind != "mutex" && kind != "map") {
+    fprintf(stderr, "usage: %s queue|stable|mutex|map [-tthreads,...] [-nops] [-wpercent] [-kkeys] [-f]\n",
+            argv[0]);
+    return -1;
+  }
+  bool queue = kind != "map";
+  std::vector<int> threads = { 1, 2, 4, 8, 16, 32, 64 };
+  long ops = 200000;
+  int writes = queue ? 50 : 20;
+  long keys = 10000;
+  bool strict = false;
+  for (int i = 2; i < argc; i++) {
+    if (strncmp(argv[i], "-t", 2) == 0) {
+      threads = parseList(argv[i] + 2);
+    } else if (strncmp(argv[i], "-n", 2) == 0) {
+      ops = atol(argv[i] + 2);
+    } else if (strncmp(argv[i], "-w", 2) == 0) {
+      writes = atoi(argv[i] + 2);
+    } else if (strncmp(argv[i], "-k", 2) == 0) {
+      keys = atol(argv[i] + 2);
+    } else if (strcmp(argv[i], "-f") == 0) {
+      strict = true;
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return -1;
+    }
+  }
+  if (threads.empty() || ops <= 0 || writes < 0 || writes > 100 || keys <= 0) {
+    fprintf(stderr, "Bad option: -t needs positive counts, -n and -k positive numbers, -w 0 to 100\n");
+    return -1;
+  }
+
+  bool ok = true;
+  printf("%-6s %8s %10s %8s %12s %8s %8s %8s %10s  %s\n", "struct", "threads", "ops", "ms",
+         "ops/s", "p50_ns", "p99_ns", "p999_ns", "max_ns", "check");
+  for (int n : threads) {
+    std::vector<std::vector<Op>> history;
+    uint64_t wall = queue ? runQueue(kind, n, ops, writes, &history)
+                          : runMap(n, ops, writes, keys, &history);
+    // the latencies of the timed operations (not the drain)
+    std::vector<uint64_t> lat;
+    for (int t = 0; t < n; t++)
+      for (auto &op : history[t])
+        lat.push_back(op.res - op.inv);
+    std::sort(lat.begin(), lat.end());
+    auto pct = [&lat](double p) { return lat[std::min(lat.size() - 1, (size_t)(p * lat.size()))]; };
+    Verdict v = queue ? checkQueue(history, strict) : checkMap(history);
+    std::string check = v.violations ? "NOT LINEARIZABLE" : "ok";
+    if (queue && v.inversions)
+      check += " (" + std::to_string(v.inversions) + " FIFO inversions)";
+    uint64_t ms = std::max<uint64_t>(wall / 1000000, 1);
+    printf("%-6s %8d %10zu %8" PRIu64 " %12.0f %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %10" PRIu64 "  %s\n",
+           argv[1], n, lat.size(), ms, lat.size() * 1e9 / std::max<uint64_t>(wall, 1),
+           pct(0.5), pct(0.99), pct(0.999), lat.back(), check.c_str());
+    if (v.violations) {
+      fprintf(stderr, "%d threads: %lu violations, the first: %s\n", n, v.violations, v.first.c_str());
+      ok = false;
+    }
+    fflush(stdout);
+  }
+  return ok ? 0 : -1;
+}
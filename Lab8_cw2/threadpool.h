@@ -0,0 +1,300 @@
+/*
+ * threadpool.h - a reusable pool of worker threads
+ *
+ * usage:
+ *
+ *   ThreadPool pool(ThreadPool::Options::fromEnv(4));
+ *   std::future<int> f = pool.submit([]() { return 42; });
+ *   f.get();
+ *
+ * tasks are run in the order they are submitted, each by whichever worker is
+ * free; submit() returns a future for the task's result (or exception)
+ *
+ * the options are
+ *
+ *   threads   - the number of workers
+ *   affinity  - NONE leaves placement to the scheduler; COMPACT pins worker i
+ *               to the i-th allowed CPU, filling one NUMA node before the
+ *               next; SCATTER deals workers out to the NUMA nodes in turn,
+ *               so each node gets an equal share of workers
+ *   idle      - BLOCK makes idle workers sleep on a condition variable; SPIN
+ *               makes them poll for work, which starts tasks sooner at the
+ *               cost of a busy CPU each
+ *
+ * and fromEnv() reads them from CRAWLER_THREADS, CRAWLER_AFFINITY
+ * (none|compact|scatter) and CRAWLER_IDLE (block|spin)
+ *
+ * NUMA nodes are read from /sys/devices/system/node/node<N>/cpulist; without
+ * them every CPU is treated as one node
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <algorithm>
+#include <functional>
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <thread>
+
+struct ThreadPool
+{
+  enum Affinity { AFFINITY_NONE, AFFINITY_COMPACT, AFFINITY_SCATTER };
+  enum Idle { IDLE_BLOCK, IDLE_SPIN };
+
+  /**
+   * @brief How a pool is made
+  */
+  struct Options
+  {
+    int threads = 1;
+    Affinity affinity = AFFINITY_NONE;
+    Idle idle = IDLE_BLOCK;
+
+    /**
+     * @brief Reads the options from the environment
+     *
+     * @param defaultThreads The number of threads if CRAWLER_THREADS is unset
+     * or not a number; a negative CRAWLER_THREADS also gives this
+     * @return Options The options
+    */
+    static Options fromEnv(int defaultThreads) {
+      Options o;
+      o.threads = defaultThreads;
+      const char *t = getenv("CRAWLER_THREADS");
+      if (t) {
+        try {
+          o.threads = std::stoi(t);
+          if (o.threads < 0)
+            o.threads = defaultThreads;
+        } catch (...) {
+          o.threads = defaultThreads;
+        }
+      }
+      const char *a = getenv("CRAWLER_AFFINITY");
+      if (a && strcmp(a, "compact") == 0)
+        o.affinity = AFFINITY_COMPACT;
+      else if (a && strcmp(a, "scatter") == 0)
+        o.affinity = AFFINITY_SCATTER;
+      else if (a && *a && strcmp(a, "none") != 0)
+        fprintf(stderr, "Unknown CRAWLER_AFFINITY %s - must be none, compact or scatter\n", a);
+      const char *i = getenv("CRAWLER_IDLE");
+      if (i && strcmp(i, "spin") == 0)
+        o.idle = IDLE_SPIN;
+      else if (i && *i && strcmp(i, "block") != 0)
+        fprintf(stderr, "Unknown CRAWLER_IDLE %s - must be block or spin\n", i);
+      return o;
+    }
+  };
+
+  Options options;
+  std::list<std::function<void()>> tasks;
+  std::mutex m;
+  std::condition_variable cv;
+  std::atomic<size_t> queued{0}; // tasks.size(), read by spinning workers without m
+  std::atomic<bool> stopping{false};
+  std::vector<std::thread> workers;
+
+  explicit ThreadPool(const Options &o) : options(o) {
+    std::vector<int> cpus = placement(o.threads, o.affinity);
+    for (int i = 0; i < o.threads; i++) {
+      workers.emplace_back(&ThreadPool::run, this);
+      if (!cpus.empty())
+        pin(workers.back(), cpus[i]);
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /**
+   * @brief Runs the tasks already submitted, then stops the workers
+  */
+  ~ThreadPool() {
+    {
+      std::unique_lock<std::mutex> lock(m);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto &w : workers)
+      w.join();
+  }
+
+  size_t size() const {
+    return workers.size();
+  }
+
+  /**
+   * @brief Queues a task for the workers
+   *
+   * A pool with no workers runs the task in the calling thread, before
+   * returning, so callers need no special case for sequential runs.
+   *
+   * @param f The task, a callable taking no arguments
+   * @return std::future The task's result
+  */
+  template <typename F>
+  auto submit(F f) -> std::future<decltype(f())> {
+    typedef decltype(f()) R;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::move(f));
+    std::future<R> result = task->get_future();
+    if (workers.empty()) {
+      (*task)();
+      return result;
+    }
+    // notified under the lock, so a task that ends the pool's owner cannot
+    // have the pool destroyed before this call is done with it
+    std::unique_lock<std::mutex> lock(m);
+    tasks.push_back([task]() { (*task)(); });
+    queued++;
+    if (options.idle == IDLE_BLOCK)
+      cv.notify_one();
+    return result;
+  }
+
+  /**
+   * @brief Lists the allowed CPUs of each NUMA node, in node order
+   *
+   * @return std::vector<std::vector<int>> The CPUs of each node that has any
+  */
+  static std::vector<std::vector<int>> numaNodes() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+      return {};
+    std::vector<std::pair<int, std::vector<int>>> nodes;
+    DIR *d = opendir("/sys/devices/system/node");
+    struct dirent *e;
+    while (d && (e = readdir(d)) != NULL) {
+      int node;
+      char extra;
+      if (sscanf(e->d_name, "node%d%c", &node, &extra) != 1)
+        continue;
+      std::string path = std::string("/sys/devices/system/node/") + e->d_name + "/cpulist";
+      FILE *fd = fopen(path.c_str(), "r");
+      if (fd == NULL)
+        continue;
+      std::vector<int> cpus;
+      int a, b;
+      // a list like "0-3,8-11,16"
+      while (fscanf(fd, "%d", &a) == 1) {
+        b = a;
+        if (fscanf(fd, "-%d", &b) != 1)
+          b = a;
+        for (int c = a; c <= b; c++)
+          if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed))
+            cpus.push_back(c);
+        if (fgetc(fd) != ',')
+          break;
+      }
+      fclose(fd);
+      if (!cpus.empty())
+        nodes.push_back({ node, cpus });
+    }
+    if (d)
+      closedir(d);
+    std::sort(nodes.begin(), nodes.end());
+    std::vector<std::vector<int>> result;
+    for (auto &n : nodes)
+      result.push_back(n.second);
+    if (result.empty()) {
+      // no NUMA information: one node with every allowed CPU
+      std::vector<int> cpus;
+      for (int c = 0; c < CPU_SETSIZE; c++)
+        if (CPU_ISSET(c, &allowed))
+          cpus.push_back(c);
+      if (!cpus.empty())
+        result.push_back(cpus);
+    }
+    return result;
+  }
+
+  /**
+   * @brief Chooses a CPU for each worker
+   *
+   * When there are more workers than CPUs the choice wraps around.
+   *
+   * @param n The number of workers
+   * @param affinity The placement policy
+   * @return std::vector<int> The CPU of each worker, or empty to not pin
+  */
+  static std::vector<int> placement(int n, Affinity affinity) {
+    if (affinity == AFFINITY_NONE || n <= 0)
+      return {};
+    std::vector<std::vector<int>> nodes = numaNodes();
+    std::vector<int> order;
+    if (affinity == AFFINITY_COMPACT) {
+      for (auto &node : nodes)
+        order.insert(order.end(), node.begin(), node.end());
+    } else {
+      // take the first CPU of every node, then the second, and so on
+      for (size_t k = 0; ; k++) {
+        bool any = false;
+        for (auto &node : nodes) {
+          if (k < node.size()) {
+            order.push_back(node[k]);
+            any = true;
+          }
+        }
+        if (!any)
+          break;
+      }
+    }
+    if (order.empty())
+      return {};
+    std::vector<int> cpus;
+    for (int i = 0; i < n; i++)
+      cpus.push_back(order[i % order.size()]);
+    return cpus;
+  }
+
+  // pin a thread to one CPU (failure leaves it unpinned)
+  static void pin(std::thread &t, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+  }
+
+  // the body of each worker
+  void run() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        if (options.idle == IDLE_BLOCK) {
+          cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+        } else {
+          while (!stopping && tasks.empty()) {
+            lock.unlock();
+            while (queued.load(std::memory_order_acquire) == 0 && !stopping)
+              std::this_thread::yield();
+            lock.lock();
+          }
+        }
+        if (tasks.empty())
+          return; // stopping, and nothing left to do
+        task = std::move(tasks.front());
+        tasks.pop_front();
+        queued--;
+      }
+      task();
+    }
+  }
+};
+
+#endif